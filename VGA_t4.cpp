@@ -15,6 +15,9 @@
 
 #include "VGA_t4.h"
 #include "VGA_font8x8.h"
+#include "profiler.h"
+#include "trace.h"
+#include "convert.h"
 
 // Objective:
 // generates VGA signal fully in hardware with as little as possible CPU help
@@ -28,7 +31,7 @@
 // - supported resolutions: 320x240,320x480,640x240 and 640x480 pixels
 // - experimental resolution: 352x240,352x480
 // - experimental resolution: 512x240,512x480 (not stable)
-// - video memory is allocated using malloc in T4 heap
+// - video memory is allocated in T4 heap (OCRAM) by default, see set_memory_policy()
 // - as the 2 DMA transfers are not started exactly at same time, there is a bit of color smearing 
 //   but tried to be compensated by pixel shifting 
 // - Default is 8bits RRRGGGBB (332) 
@@ -66,6 +69,7 @@
 // Full buffer including back/front porch 
 static vga_pixel *gfxbuffer;
 static void *gfxbufferP;
+static uint32_t gfxbuffer_size = 0;
 
 // Visible vuffer
 static vga_pixel * framebuffer;
@@ -83,6 +87,11 @@ static int  ref_freq_denom;
 static int  ref_pix_shift;
 static int  combine_shiftreg;
 
+// writeLine/writeScreen scaler source size (see set_scaler)
+static int  scale_src_width = 0;
+static int  scale_src_height = 0;
+static void build_scaler();
+
 #ifdef DEBUG
 static uint32_t   ISRTicks_prev = 0;
 volatile uint32_t ISRTicks = 0;
@@ -91,16 +100,141 @@ volatile uint32_t ISRTicks = 0;
 uint8_t    VGA_T4::_vsync_pin = -1;
 DMAChannel VGA_T4::flexio1DMA;
 DMAChannel VGA_T4::flexio2DMA; 
+DMAChannel VGA_T4::audioDMA;
+DMAChannel VGA_T4::blitDMA;
 static volatile uint32_t VSYNC = 0;
 static volatile uint32_t currentLine=0;
+static volatile bool audio_refill_pending = false;
+static uint8_t audio_sync = AUDIO_SYNC_NONE;
+
+// work queued for SOFTWARE_isr
+#define SW_AUDIO     0x01
+#define SW_VBLANK    0x02
+#define SW_STREAM    0x04
+#define SW_LINE      0x10   // << callback slot
+static volatile uint32_t sw_pending = 0;
+
+static volatile uint32_t frame_count = 0;
+static volatile uint32_t wait_line = 0xffffffff;
+static volatile bool     wait_line_hit = false;
+static uint32_t vblank_line = 0;
+static vga_raster_callback_t vblank_callback = NULL;
+static bool vblank_deferred = true;
+
+typedef struct {
+  vga_raster_callback_t callback;
+  uint16_t line;
+  bool     deferred;
+} LineCallback_t;
+static LineCallback_t line_callbacks[VGA_LINE_CALLBACKS];
+static volatile uint8_t nb_line_callbacks = 0;
+
+// line streaming (see begin_stream)
+typedef struct {
+  const void * line;
+  int16_t      y;
+} StreamLine_t;
+static volatile bool     stream_active = false;
+static vga_pixel *       stream_buffer = NULL;       // VGA_STREAM_LINES lines of fb_stride
+static volatile int16_t  stream_tag[VGA_STREAM_LINES];  // source row held by each line buffer
+static volatile int16_t  stream_beam = -1;           // source row being scanned, -1 in the blanking
+static uint16_t          stream_src_row[VGA_SCALE_MAX];  // source row of each screen row
+static StreamLine_t      stream_queue[VGA_STREAM_QUEUE];
+static volatile uint32_t stream_head = 0;
+static volatile uint32_t stream_tail = 0;
+static volatile uint32_t stream_late = 0;
+static volatile uint32_t stream_missing = 0;
+
+// orders the queue slot stores before the head publish (as AudioRing)
+static inline void stream_barrier()
+{
+#if defined(__arm__)
+  asm volatile("dmb" ::: "memory");
+#else
+  __sync_synchronize();
+#endif
+}
+
+// asynchronous blitter (see blit_submit)
+typedef struct {
+  const uint8_t * src;      // NULL for a fill
+  uint8_t *       dst;
+  uint32_t        src_stride;
+  uint32_t        row_bytes;
+  uint16_t        rows;
+  vga_pixel       color;
+} BlitJob_t;
+
+static BlitJob_t blit_queue[VGA_BLIT_QUEUE];
+static volatile uint32_t blit_head = 0;        // jobs submitted
+static volatile uint32_t blit_tail = 0;        // jobs completed
+static volatile uint16_t blit_rows_left = 0;
+static volatile bool     blit_busy = false;
+static bool              blit_ready = false;
+static uint32_t          blit_fill_word __attribute__((aligned(4)));
+
+static inline void raise_software(uint32_t what)
+{
+  __atomic_fetch_or(&sw_pending, what, __ATOMIC_RELAXED);
+  NVIC_SET_PENDING(IRQ_SOFTWARE);
+}
 //#define NOP asm volatile("nop\n\t");
 
 
 
 PolyDef	PolySet;  // will contain a polygon data
 
+#ifdef VGA_SCANOUT_STATS
+static vga_scanout_stats_t scanout_stats;
+static uint16_t scanout_late_ticks = SCANOUT_LATE_TICKS;
+static uint16_t frame_lat_min = 0xffff;
+static uint16_t frame_lat_max = 0;
+static uint16_t frame_arm_max = 0;
+static uint16_t frame_late = 0;
+static uint32_t late_map[2][(SCANOUT_LINES+31)/32];
+static uint8_t  late_map_cur = 0;
+
+// entry: counter at ISR entry, arm: counter after DMA re-arm (0 in the blanking)
+static FASTRUN void scanout_record(uint32_t line, uint16_t entry, uint16_t arm)
+{
+  uint32_t bin = entry >> SCANOUT_HIST_SHIFT;
+  if (bin >= SCANOUT_HIST_BINS) bin = SCANOUT_HIST_BINS-1;
+  scanout_stats.hist[bin]++;
+  scanout_stats.lines++;
+  if (entry < frame_lat_min) frame_lat_min = entry;
+  if (entry > frame_lat_max) frame_lat_max = entry;
+  if (arm > frame_arm_max) frame_arm_max = arm;
+  if (arm > scanout_late_ticks) {
+    late_map[late_map_cur][line >> 5] |= 1u << (line & 31);
+    frame_late++;
+  }
+  if (line == 0) {
+    // frame done: publish it and start the next one
+    scanout_stats.lat_min = frame_lat_min;
+    scanout_stats.lat_max = frame_lat_max;
+    scanout_stats.jitter  = frame_lat_max - frame_lat_min;
+    if (scanout_stats.jitter > scanout_stats.jitter_max) scanout_stats.jitter_max = scanout_stats.jitter;
+    scanout_stats.arm_max    = frame_arm_max;
+    scanout_stats.late_lines = frame_late;
+    scanout_stats.late_total += frame_late;
+    scanout_stats.frames++;
+    frame_lat_min = 0xffff;
+    frame_lat_max = 0;
+    frame_arm_max = 0;
+    frame_late    = 0;
+    late_map_cur ^= 1;
+    memset((void*)late_map[late_map_cur], 0, sizeof(late_map[0]));
+  }
+}
+#endif
+
 
 FASTRUN void VGA_T4::QT3_isr(void) {
+  PROFILE_START(isr_start);
+#ifdef VGA_SCANOUT_STATS
+  uint16_t entry_ticks = TMR3_CNTR3;   // counter restarts on the HSYNC edge
+  uint16_t arm_ticks = 0;
+#endif
   TMR3_SCTRL3 &= ~(TMR_SCTRL_TCF);
   TMR3_CSCTRL3 &= ~(TMR_CSCTRL_TCF1|TMR_CSCTRL_TCF2);
   
@@ -124,34 +258,75 @@ FASTRUN void VGA_T4::QT3_isr(void) {
     //DMA_CERQ = flexio2DMA.channel;
     //DMA_CERQ = flexio1DMA.channel; 
 
+    vga_pixel * line = &gfxbuffer[fb_stride*y];
+    if (stream_active) {
+      // streamed line buffer when its source row is in, framebuffer row otherwise
+      int src = stream_src_row[y];
+      stream_beam = src;
+      if (stream_tag[src & (VGA_STREAM_LINES-1)] == src) line = &stream_buffer[(src & (VGA_STREAM_LINES-1))*fb_stride];
+      else stream_missing++;
+      if (stream_head != stream_tail) raise_software(SW_STREAM);
+    }
+
     // Setup source adress
     // Aligned 32 bits copy
-    unsigned long * p=(uint32_t *)&gfxbuffer[fb_stride*y];  
+    unsigned long * p=(uint32_t *)line;  
     flexio2DMA.TCD->SADDR = p;
     if (pix_shift & DMA_HACK) 
     {
       // Unaligned copy
-      uint8_t * p2=(uint8_t *)&gfxbuffer[fb_stride*y+(pix_shift&0xf)];
+      uint8_t * p2=(uint8_t *)&line[pix_shift&0xf];
       flexio1DMA.TCD->SADDR = p2;
     }
     else  {
-      p=(uint32_t *)&gfxbuffer[fb_stride*y+(pix_shift&0xc)]; // multiple of 4
+      p=(uint32_t *)&line[pix_shift&0xc]; // multiple of 4
       flexio1DMA.TCD->SADDR = p;
     }
 
     // Enable DMAs
     DMA_SERQ = flexio2DMA.channel; 
     DMA_SERQ = flexio1DMA.channel; 
-    //arm_dcache_flush_delete((void*)((uint32_t *)&gfxbuffer[fb_stride*y]), fb_stride);
-    arm_dcache_flush((void*)((uint32_t *)&gfxbuffer[fb_stride*y]), fb_stride);
+#ifdef VGA_SCANOUT_STATS
+    arm_ticks = TMR3_CNTR3;
+#endif
+    //arm_dcache_flush_delete((void*)((uint32_t *)line), fb_stride);
+    arm_dcache_flush((void*)((uint32_t *)line), fb_stride);
   }  else {
+    // vertical blanking: no pixel DMA to disturb
+    if (stream_active) {
+      stream_beam = -1;
+      if (stream_head != stream_tail) raise_software(SW_STREAM);
+    }
     asm volatile("dsb");
   }
 
+  // raster events
+  if (currentLine == 0) frame_count++;
+  if (currentLine == wait_line) wait_line_hit = true;
+  // deferred audio refill: released on the first blanking line only, so
+  // that it has the whole blanking to run before the next active line
+  if (currentLine == vblank_line && audio_refill_pending) {
+    audio_refill_pending = false;
+    raise_software(SW_AUDIO);
+  }
+  if (currentLine == vblank_line && vblank_callback != NULL) {
+    if (vblank_deferred) raise_software(SW_VBLANK);
+    else vblank_callback(currentLine);
+  }
+  for (int i=0; i<nb_line_callbacks; i++) {
+    if (line_callbacks[i].line == currentLine && line_callbacks[i].callback != NULL) {
+      if (line_callbacks[i].deferred) raise_software(SW_LINE << i);
+      else line_callbacks[i].callback(currentLine);
+    }
+  }
+
 #ifdef DEBUG
   ISRTicks++; 
 #endif  
-
+#ifdef VGA_SCANOUT_STATS
+  scanout_record(currentLine, entry_ticks, arm_ticks);
+#endif
+  PROFILE_STOP(isr_start, PROF_QT3_ISR);
 }
 
 
@@ -227,202 +402,159 @@ void VGA_T4::tweak_video(int shiftdelta, int numdelta, int denomdelta)
   }
 }
 
-// display VGA image
-FLASHMEM
-vga_error_t VGA_T4::begin(vga_mode_t mode)
-{
+// PLL5 setting shared by all modes
+//#define VIDEO_DIV_SELECT  49
+//#define VIDEO_NUM         135
+//#define VIDEO_DENOM       100
+#define VIDEO_DIV_SELECT  20
+#define VIDEO_NUM         9800
+#define VIDEO_DENOM       10000
+#define VIDEO_FLEXIO_FREQ ( ( 24000*VIDEO_DIV_SELECT + (VIDEO_NUM*24000)/VIDEO_DENOM )/POST_DIV_SELECT )
+
+// Geometry and pixel clock of a mode, false if the mode is unknown
+typedef struct {
+  int      left_border;
+  int      right_border;
+  int      fb_width;
+  int      fb_height;
+  int      fb_stride;
+  int      maxpixperline;
+  int      line_double;
+  int      pix_shift;
+  int      combine_shiftreg;
   uint32_t flexio_clock_div;
-  combine_shiftreg = 0;
-//  int div_select = 49;
-//  int num = 135;  
-//  int denom = 100;  
-  int div_select = 20;
-  int num = 9800;
-  int denom = 10000;  
-  int flexio_clk_sel = FLEXIO_CLK_SEL_PLL5;   
-  int flexio_freq = ( 24000*div_select + (num*24000)/denom )/POST_DIV_SELECT;
-  set_videoClock(div_select,num,denom,true);
+} ModeDef_t;
+
+static bool mode_def(vga_mode_t mode, ModeDef_t * def)
+{
+  int flexio_freq = VIDEO_FLEXIO_FREQ;
+  def->combine_shiftreg = 0;
   switch(mode) {
     case VGA_MODE_320x240:
-      left_border = backporch_pix/2;
-      right_border = frontporch_pix/2;
-      fb_width = 320;
-      fb_height = 240 ;
-      fb_stride = left_border+fb_width+right_border;
-      maxpixperline = fb_stride;
-      flexio_clock_div = flexio_freq/(pix_freq/2);
-      line_double = 1;
-      pix_shift = 2+DMA_HACK;
+      def->left_border = backporch_pix/2;
+      def->right_border = frontporch_pix/2;
+      def->fb_width = 320;
+      def->fb_height = 240 ;
+      def->fb_stride = def->left_border+def->fb_width+def->right_border;
+      def->maxpixperline = def->fb_stride;
+      def->flexio_clock_div = flexio_freq/(pix_freq/2);
+      def->line_double = 1;
+      def->pix_shift = 2+DMA_HACK;
       break;
     case VGA_MODE_320x480:
-      left_border = backporch_pix/2;
-      right_border = frontporch_pix/2;
-      fb_width = 320;
-      fb_height = 480 ;
-      fb_stride = left_border+fb_width+right_border;
-      maxpixperline = fb_stride;
-      flexio_clock_div = flexio_freq/(pix_freq/2); 
-      line_double = 0;
-      pix_shift = 2+DMA_HACK;
+      def->left_border = backporch_pix/2;
+      def->right_border = frontporch_pix/2;
+      def->fb_width = 320;
+      def->fb_height = 480 ;
+      def->fb_stride = def->left_border+def->fb_width+def->right_border;
+      def->maxpixperline = def->fb_stride;
+      def->flexio_clock_div = flexio_freq/(pix_freq/2); 
+      def->line_double = 0;
+      def->pix_shift = 2+DMA_HACK;
       break;   
     case VGA_MODE_640x240:
-      left_border = backporch_pix;
-      right_border = frontporch_pix;
-      fb_width = 640;
-      fb_height = 240 ;
-      fb_stride = left_border+fb_width+right_border;
-      maxpixperline = fb_stride;
-      flexio_clock_div = flexio_freq/pix_freq;
-      line_double = 1;
-      pix_shift = 4;
-      combine_shiftreg = 1;
+      def->left_border = backporch_pix;
+      def->right_border = frontporch_pix;
+      def->fb_width = 640;
+      def->fb_height = 240 ;
+      def->fb_stride = def->left_border+def->fb_width+def->right_border;
+      def->maxpixperline = def->fb_stride;
+      def->flexio_clock_div = flexio_freq/pix_freq;
+      def->line_double = 1;
+      def->pix_shift = 4;
+      def->combine_shiftreg = 1;
       break;
     case VGA_MODE_640x480:
-      left_border = backporch_pix;
-      right_border = frontporch_pix;
-      fb_width = 640;
-      fb_height = 480 ;
-      fb_stride = left_border+fb_width+right_border;
-      maxpixperline = fb_stride;
-      flexio_clock_div = (flexio_freq/pix_freq); 
-      line_double = 0;
-      pix_shift = 4;
-      combine_shiftreg = 1;
+      def->left_border = backporch_pix;
+      def->right_border = frontporch_pix;
+      def->fb_width = 640;
+      def->fb_height = 480 ;
+      def->fb_stride = def->left_border+def->fb_width+def->right_border;
+      def->maxpixperline = def->fb_stride;
+      def->flexio_clock_div = (flexio_freq/pix_freq); 
+      def->line_double = 0;
+      def->pix_shift = 4;
+      def->combine_shiftreg = 1;
       break;   
     case VGA_MODE_512x240:
-      left_border = backporch_pix/1.3;
-      right_border = frontporch_pix/1.3;
-      fb_width = 512;
-      fb_height = 240 ;
-      fb_stride = left_border+fb_width+right_border;
-      maxpixperline = fb_stride;
-      flexio_clock_div = flexio_freq/(pix_freq/1.3)+2; 
-      line_double = 1;
-      pix_shift = 0;
+      def->left_border = backporch_pix/1.3;
+      def->right_border = frontporch_pix/1.3;
+      def->fb_width = 512;
+      def->fb_height = 240 ;
+      def->fb_stride = def->left_border+def->fb_width+def->right_border;
+      def->maxpixperline = def->fb_stride;
+      def->flexio_clock_div = flexio_freq/(pix_freq/1.3)+2; 
+      def->line_double = 1;
+      def->pix_shift = 0;
       break;
     case VGA_MODE_512x480:
-      left_border = backporch_pix/1.3;
-      right_border = frontporch_pix/1.3;
-      fb_width = 512;
-      fb_height = 480 ;
-      fb_stride = left_border+fb_width+right_border;
-      maxpixperline = fb_stride;
-      flexio_clock_div = flexio_freq/(pix_freq/1.3)+2; 
-      line_double = 0;
-      pix_shift = 0;
+      def->left_border = backporch_pix/1.3;
+      def->right_border = frontporch_pix/1.3;
+      def->fb_width = 512;
+      def->fb_height = 480 ;
+      def->fb_stride = def->left_border+def->fb_width+def->right_border;
+      def->maxpixperline = def->fb_stride;
+      def->flexio_clock_div = flexio_freq/(pix_freq/1.3)+2; 
+      def->line_double = 0;
+      def->pix_shift = 0;
       break; 
     case VGA_MODE_352x240:
-      left_border = backporch_pix/1.75;
-      right_border = frontporch_pix/1.75;
-      fb_width = 352;
-      fb_height = 240 ;
-      fb_stride = left_border+fb_width+right_border;
-      maxpixperline = fb_stride;
-      flexio_clock_div = flexio_freq/(pix_freq/1.75)+2; 
-      line_double = 1;
-      pix_shift = 2+DMA_HACK;
+      def->left_border = backporch_pix/1.75;
+      def->right_border = frontporch_pix/1.75;
+      def->fb_width = 352;
+      def->fb_height = 240 ;
+      def->fb_stride = def->left_border+def->fb_width+def->right_border;
+      def->maxpixperline = def->fb_stride;
+      def->flexio_clock_div = flexio_freq/(pix_freq/1.75)+2; 
+      def->line_double = 1;
+      def->pix_shift = 2+DMA_HACK;
       break;
     case VGA_MODE_352x480:
-      left_border = backporch_pix/1.75;
-      right_border = frontporch_pix/1.75;
-      fb_width = 352;
-      fb_height = 480 ;
-      fb_stride = left_border+fb_width+right_border;
-      maxpixperline = fb_stride;
-      flexio_clock_div = flexio_freq/(pix_freq/1.75)+2; 
-      line_double = 0;
-      pix_shift = 2+DMA_HACK;
+      def->left_border = backporch_pix/1.75;
+      def->right_border = frontporch_pix/1.75;
+      def->fb_width = 352;
+      def->fb_height = 480 ;
+      def->fb_stride = def->left_border+def->fb_width+def->right_border;
+      def->maxpixperline = def->fb_stride;
+      def->flexio_clock_div = flexio_freq/(pix_freq/1.75)+2; 
+      def->line_double = 0;
+      def->pix_shift = 2+DMA_HACK;
       break;         
-  }	
-
-  // Save param for tweek adjustment
-  ref_div_select = div_select;
-  ref_freq_num = num;
-  ref_freq_denom = denom;
-  ref_pix_shift = pix_shift;
-
-  Serial.println("frequency");
-  Serial.println(flexio_freq);
-  Serial.println("div");
-  Serial.println(flexio_freq/pix_freq);
-
-  pinMode(_vsync_pin, OUTPUT);
-  pinMode(PIN_HBLANK, OUTPUT);
-
-  /* Basic pin setup FlexIO1 */
-  pinMode(PIN_G_B2, OUTPUT);  // FlexIO1:4 = 0x10
-  pinMode(PIN_R_B0, OUTPUT);  // FlexIO1:5 = 0x20
-  pinMode(PIN_R_B1, OUTPUT);  // FlexIO1:6 = 0x40
-  pinMode(PIN_R_B2, OUTPUT);  // FlexIO1:7 = 0x80
-#ifdef BITS12
-  pinMode(PIN_R_B3, OUTPUT);  // FlexIO1:8 = 0x100
-#endif
-  /* Basic pin setup FlexIO2 */
-  pinMode(PIN_B_B0, OUTPUT);  // FlexIO2:0 = 0x00001
-  pinMode(PIN_B_B1, OUTPUT);  // FlexIO2:1 = 0x00002
-  pinMode(PIN_G_B0, OUTPUT);  // FlexIO2:2 = 0x00004
-  pinMode(PIN_G_B1, OUTPUT);  // FlexIO2:3 = 0x00008
-#ifdef BITS12
-  pinMode(PIN_B_B2, OUTPUT);  // FlexIO2:10 = 0x00400
-  pinMode(PIN_B_B3, OUTPUT);  // FlexIO2:11 = 0x00800
-  pinMode(PIN_G_B3, OUTPUT);  // FlexIO2:12 = 0x01000
-#endif
-
-  /* High speed and drive strength configuration */
-  *(portControlRegister(PIN_G_B2)) = 0xFF; 
-  *(portControlRegister(PIN_R_B0)) = 0xFF;
-  *(portControlRegister(PIN_R_B1)) = 0xFF;
-  *(portControlRegister(PIN_R_B2)) = 0xFF;
-#ifdef BITS12
-  *(portControlRegister(PIN_R_B3)) = 0xFF;
-#endif
-  *(portControlRegister(PIN_B_B0)) = 0xFF; 
-  *(portControlRegister(PIN_B_B1)) = 0xFF;
-  *(portControlRegister(PIN_G_B0)) = 0xFF;
-  *(portControlRegister(PIN_G_B1)) = 0xFF;
-#ifdef BITS12  
-  *(portControlRegister(PIN_B_B2))  = 0xFF;
-  *(portControlRegister(PIN_B_B3))  = 0xFF;
-  *(portControlRegister(PIN_G_B3)) = 0xFF;
-#endif
-
-
-  /* Set clock for FlexIO1 and FlexIO2 */
-  CCM_CCGR5 &= ~CCM_CCGR5_FLEXIO1(CCM_CCGR_ON);
-  CCM_CDCDR = (CCM_CDCDR & ~(CCM_CDCDR_FLEXIO1_CLK_SEL(3) | CCM_CDCDR_FLEXIO1_CLK_PRED(7) | CCM_CDCDR_FLEXIO1_CLK_PODF(7))) 
-    | CCM_CDCDR_FLEXIO1_CLK_SEL(flexio_clk_sel) | CCM_CDCDR_FLEXIO1_CLK_PRED(0) | CCM_CDCDR_FLEXIO1_CLK_PODF(0);
-  CCM_CCGR3 &= ~CCM_CCGR3_FLEXIO2(CCM_CCGR_ON);
-  CCM_CSCMR2 = (CCM_CSCMR2 & ~(CCM_CSCMR2_FLEXIO2_CLK_SEL(3))) | CCM_CSCMR2_FLEXIO2_CLK_SEL(flexio_clk_sel);
-  CCM_CS1CDR = (CCM_CS1CDR & ~(CCM_CS1CDR_FLEXIO2_CLK_PRED(7)|CCM_CS1CDR_FLEXIO2_CLK_PODF(7)) )
-    | CCM_CS1CDR_FLEXIO2_CLK_PRED(0) | CCM_CS1CDR_FLEXIO2_CLK_PODF(0);
+    default:
+      return false;
+  }
+  return true;
+}
 
+static void apply_mode(const ModeDef_t * def)
+{
+  left_border = def->left_border;
+  right_border = def->right_border;
+  fb_width = def->fb_width;
+  fb_height = def->fb_height;
+  fb_stride = def->fb_stride;
+  maxpixperline = def->maxpixperline;
+  line_double = def->line_double;
+  pix_shift = def->pix_shift;
+  combine_shiftreg = def->combine_shiftreg;
+}
 
- /* Set up pin mux FlexIO1 */
-  *(portConfigRegister(PIN_G_B2)) = 0x14;
-  *(portConfigRegister(PIN_R_B0)) = 0x14;
-  *(portConfigRegister(PIN_R_B1)) = 0x14;
-  *(portConfigRegister(PIN_R_B2)) = 0x14;
-#ifdef BITS12
-  *(portConfigRegister(PIN_R_B3)) = 0x14;
-#endif
-  /* Set up pin mux FlexIO2 */
-  *(portConfigRegister(PIN_B_B0)) = 0x14;
-  *(portConfigRegister(PIN_B_B1)) = 0x14;
-  *(portConfigRegister(PIN_G_B0)) = 0x14;
-  *(portConfigRegister(PIN_G_B1)) = 0x14;
-#ifdef BITS12
-  *(portConfigRegister(PIN_B_B2)) = 0x14;
-  *(portConfigRegister(PIN_B_B3)) = 0x14;
-  *(portConfigRegister(PIN_G_B3)) = 0x14;
-#endif
+static uint32_t mode_buffer_size(const ModeDef_t * def)
+{
+  return def->fb_stride*def->fb_height*sizeof(vga_pixel)+4; // 4bytes for pixel shift
+}
 
-  /* Enable the clock */
-  CCM_CCGR5 |= CCM_CCGR5_FLEXIO1(CCM_CCGR_ON);
-  CCM_CCGR3 |= CCM_CCGR3_FLEXIO2(CCM_CCGR_ON);
-  /* Enable the FlexIO with fast access */
-  FLEXIO1_CTRL = FLEXIO_CTRL_FLEXEN | FLEXIO_CTRL_FASTACC;
-  FLEXIO2_CTRL = FLEXIO_CTRL_FLEXEN | FLEXIO_CTRL_FASTACC;
+uint32_t VGA_T4::get_mode_buffer_size(vga_mode_t mode)
+{
+  ModeDef_t def;
+  if (!mode_def(mode, &def)) return 0;
+  return mode_buffer_size(&def);
+}
 
+// FlexIO shifters/timers and line DMAs for the current mode
+FLASHMEM
+void VGA_T4::config_scanout(uint32_t flexio_clock_div)
+{
   uint32_t timerSelect, timerPolarity, pinConfig, pinSelect, pinPolarity, shifterMode, parallelWidth, inputSource, stopBit, startBit;
   uint32_t triggerSelect, triggerPolarity, triggerSource, timerMode, timerOutput, timerDecrement, timerReset, timerDisable, timerEnable;
 
@@ -464,6 +596,11 @@ vga_error_t VGA_T4::begin(vga_mode_t mode)
     FLEXIO1_SHIFTCFG1 = parallelWidth | inputSource | stopBit | startBit;
     FLEXIO1_SHIFTCTL1 = timerSelect | timerPolarity | pinConfig | shifterMode;
   }
+  else {
+    // may be left over from a previous mode
+    FLEXIO2_SHIFTCTL1 = 0;
+    FLEXIO1_SHIFTCTL1 = 0;
+  }
   /* Timer 0 registers for FlexIO2 */ 
   timerOutput = FLEXIO_TIMCFG_TIMOUT(1);      // Timer output is logic zero when enabled and is not affected by the Timer reset
   timerDecrement = FLEXIO_TIMCFG_TIMDEC(0);   // Timer decrements on FlexIO clock, shift clock equals timer output
@@ -510,12 +647,12 @@ vga_error_t VGA_T4::begin(vga_mode_t mode)
 
   /* Enable DMA trigger on Shifter0, DMA request is generated when data is transferred from buffer0 to shifter0 */ 
   if (combine_shiftreg) {
-    FLEXIO2_SHIFTSDEN |= (1<<1); 
-    FLEXIO1_SHIFTSDEN |= (1<<1);
+    FLEXIO2_SHIFTSDEN = (1<<1); 
+    FLEXIO1_SHIFTSDEN = (1<<1);
   }
   else {
-    FLEXIO2_SHIFTSDEN |= (1<<0); 
-    FLEXIO1_SHIFTSDEN |= (1<<0);
+    FLEXIO2_SHIFTSDEN = (1<<0); 
+    FLEXIO1_SHIFTSDEN = (1<<0);
   }
   /* Disable DMA channel so it doesn't start transferring yet */
   flexio1DMA.disable();
@@ -611,6 +748,116 @@ vga_error_t VGA_T4::begin(vga_mode_t mode)
 #ifdef DEBUG
   Serial.println("DMA setup complete");
 #endif
+}
+
+vga_error_t VGA_T4::begin(vga_mode_t mode)
+{
+  return begin(mode, mode);
+}
+
+// display VGA image
+FLASHMEM
+vga_error_t VGA_T4::begin(vga_mode_t mode, vga_mode_t pool_mode)
+{
+  ModeDef_t def;
+  if (!mode_def(mode, &def)) return(VGA_ERROR);
+  int div_select = VIDEO_DIV_SELECT;
+  int num = VIDEO_NUM;
+  int denom = VIDEO_DENOM;  
+  int flexio_clk_sel = FLEXIO_CLK_SEL_PLL5;   
+  int flexio_freq = VIDEO_FLEXIO_FREQ;
+  set_videoClock(div_select,num,denom,true);
+  apply_mode(&def);
+
+  // Save param for tweek adjustment
+  ref_div_select = div_select;
+  ref_freq_num = num;
+  ref_freq_denom = denom;
+  ref_pix_shift = pix_shift;
+
+  Serial.println("frequency");
+  Serial.println(flexio_freq);
+  Serial.println("div");
+  Serial.println(flexio_freq/pix_freq);
+
+  pinMode(_vsync_pin, OUTPUT);
+  pinMode(PIN_HBLANK, OUTPUT);
+
+  /* Basic pin setup FlexIO1 */
+  pinMode(PIN_G_B2, OUTPUT);  // FlexIO1:4 = 0x10
+  pinMode(PIN_R_B0, OUTPUT);  // FlexIO1:5 = 0x20
+  pinMode(PIN_R_B1, OUTPUT);  // FlexIO1:6 = 0x40
+  pinMode(PIN_R_B2, OUTPUT);  // FlexIO1:7 = 0x80
+#ifdef BITS12
+  pinMode(PIN_R_B3, OUTPUT);  // FlexIO1:8 = 0x100
+#endif
+  /* Basic pin setup FlexIO2 */
+  pinMode(PIN_B_B0, OUTPUT);  // FlexIO2:0 = 0x00001
+  pinMode(PIN_B_B1, OUTPUT);  // FlexIO2:1 = 0x00002
+  pinMode(PIN_G_B0, OUTPUT);  // FlexIO2:2 = 0x00004
+  pinMode(PIN_G_B1, OUTPUT);  // FlexIO2:3 = 0x00008
+#ifdef BITS12
+  pinMode(PIN_B_B2, OUTPUT);  // FlexIO2:10 = 0x00400
+  pinMode(PIN_B_B3, OUTPUT);  // FlexIO2:11 = 0x00800
+  pinMode(PIN_G_B3, OUTPUT);  // FlexIO2:12 = 0x01000
+#endif
+
+  /* High speed and drive strength configuration */
+  *(portControlRegister(PIN_G_B2)) = 0xFF; 
+  *(portControlRegister(PIN_R_B0)) = 0xFF;
+  *(portControlRegister(PIN_R_B1)) = 0xFF;
+  *(portControlRegister(PIN_R_B2)) = 0xFF;
+#ifdef BITS12
+  *(portControlRegister(PIN_R_B3)) = 0xFF;
+#endif
+  *(portControlRegister(PIN_B_B0)) = 0xFF; 
+  *(portControlRegister(PIN_B_B1)) = 0xFF;
+  *(portControlRegister(PIN_G_B0)) = 0xFF;
+  *(portControlRegister(PIN_G_B1)) = 0xFF;
+#ifdef BITS12  
+  *(portControlRegister(PIN_B_B2))  = 0xFF;
+  *(portControlRegister(PIN_B_B3))  = 0xFF;
+  *(portControlRegister(PIN_G_B3)) = 0xFF;
+#endif
+
+
+  /* Set clock for FlexIO1 and FlexIO2 */
+  CCM_CCGR5 &= ~CCM_CCGR5_FLEXIO1(CCM_CCGR_ON);
+  CCM_CDCDR = (CCM_CDCDR & ~(CCM_CDCDR_FLEXIO1_CLK_SEL(3) | CCM_CDCDR_FLEXIO1_CLK_PRED(7) | CCM_CDCDR_FLEXIO1_CLK_PODF(7))) 
+    | CCM_CDCDR_FLEXIO1_CLK_SEL(flexio_clk_sel) | CCM_CDCDR_FLEXIO1_CLK_PRED(0) | CCM_CDCDR_FLEXIO1_CLK_PODF(0);
+  CCM_CCGR3 &= ~CCM_CCGR3_FLEXIO2(CCM_CCGR_ON);
+  CCM_CSCMR2 = (CCM_CSCMR2 & ~(CCM_CSCMR2_FLEXIO2_CLK_SEL(3))) | CCM_CSCMR2_FLEXIO2_CLK_SEL(flexio_clk_sel);
+  CCM_CS1CDR = (CCM_CS1CDR & ~(CCM_CS1CDR_FLEXIO2_CLK_PRED(7)|CCM_CS1CDR_FLEXIO2_CLK_PODF(7)) )
+    | CCM_CS1CDR_FLEXIO2_CLK_PRED(0) | CCM_CS1CDR_FLEXIO2_CLK_PODF(0);
+
+
+ /* Set up pin mux FlexIO1 */
+  *(portConfigRegister(PIN_G_B2)) = 0x14;
+  *(portConfigRegister(PIN_R_B0)) = 0x14;
+  *(portConfigRegister(PIN_R_B1)) = 0x14;
+  *(portConfigRegister(PIN_R_B2)) = 0x14;
+#ifdef BITS12
+  *(portConfigRegister(PIN_R_B3)) = 0x14;
+#endif
+  /* Set up pin mux FlexIO2 */
+  *(portConfigRegister(PIN_B_B0)) = 0x14;
+  *(portConfigRegister(PIN_B_B1)) = 0x14;
+  *(portConfigRegister(PIN_G_B0)) = 0x14;
+  *(portConfigRegister(PIN_G_B1)) = 0x14;
+#ifdef BITS12
+  *(portConfigRegister(PIN_B_B2)) = 0x14;
+  *(portConfigRegister(PIN_B_B3)) = 0x14;
+  *(portConfigRegister(PIN_G_B3)) = 0x14;
+#endif
+
+  /* Enable the clock */
+  CCM_CCGR5 |= CCM_CCGR5_FLEXIO1(CCM_CCGR_ON);
+  CCM_CCGR3 |= CCM_CCGR3_FLEXIO2(CCM_CCGR_ON);
+  /* Enable the FlexIO with fast access */
+  FLEXIO1_CTRL = FLEXIO_CTRL_FLEXEN | FLEXIO_CTRL_FASTACC;
+  FLEXIO2_CTRL = FLEXIO_CTRL_FLEXEN | FLEXIO_CTRL_FASTACC;
+
+  config_scanout(def.flexio_clock_div);
 
   // enable clocks for QTIMER3: generates the 15KHz for hsync
   // Pulse:
@@ -645,20 +892,32 @@ vga_error_t VGA_T4::begin(vga_mode_t mode)
   attachInterruptVector(IRQ_QTIMER3, QT3_isr);  //declare which routine performs the ISR function
   NVIC_SET_PRIORITY(IRQ_QTIMER3, 0); 
   NVIC_ENABLE_IRQ(IRQ_QTIMER3);  
+
+  // deferred raster callbacks (shared with the audio refill)
+  vblank_line = TOP_BORDER + (fb_height << line_double);
+  attachInterruptVector(IRQ_SOFTWARE, SOFTWARE_isr);
+  NVIC_SET_PRIORITY(IRQ_SOFTWARE, 208);
+  NVIC_ENABLE_IRQ(IRQ_SOFTWARE);
 #ifdef DEBUG
   Serial.println("QTIMER3 setup complete");
   Serial.print("V-PIN is ");
   Serial.println(_vsync_pin);
 #endif
 
-  /* initialize gfx buffer */
-  #define ALIGNDMA 32
+  /* initialize gfx buffer, sized for the largest mode setMode() will use */
+  uint32_t size = mode_buffer_size(&def);
+  if (get_mode_buffer_size(pool_mode) > size) size = get_mode_buffer_size(pool_mode);
+  if (gfxbufferP != NULL && gfxbuffer_size < size) {
+    mem_free(gfxbufferP);
+    gfxbufferP = NULL;
+  }
   if (gfxbufferP == NULL) {
-	  gfxbufferP = malloc(fb_stride*fb_height*sizeof(vga_pixel)+4+(ALIGNDMA-1) ); // 4bytes for pixel shift 
-	  gfxbuffer = (vga_pixel*) ((void*)((intptr_t)gfxbufferP & ~ALIGNDMA)); //Align buffer;
+	  gfxbufferP = mem_alloc(VGA_BUF_SCANOUT, size);
+	  gfxbuffer = (vga_pixel*)gfxbufferP; // mem_alloc returns DMA aligned buffers
+	  gfxbuffer_size = (gfxbufferP != NULL) ? size : 0;
   }	  
   if (gfxbuffer == NULL) return(VGA_ERROR);  
-  memset((void*)&gfxbuffer[0],0, fb_stride*fb_height*sizeof(vga_pixel)+4);  
+  memset((void*)&gfxbuffer[0],0, gfxbuffer_size);  
   framebuffer = (vga_pixel*)&gfxbuffer[left_border];
 
   return(VGA_OK);
@@ -666,19 +925,57 @@ vga_error_t VGA_T4::begin(vga_mode_t mode)
 
 void VGA_T4::end()
 {
+  end_stream();
+  // queued blits still write into the scanout buffer
+  blit_wait(blit_head);
   cli(); 
   /* Disable DMA channel so it doesn't start transferring yet */
   flexio1DMA.disable();
   flexio2DMA.disable(); 
-  FLEXIO2_SHIFTSDEN &= ~(1<<0);
-  FLEXIO1_SHIFTSDEN &= ~(1<<0);
+  FLEXIO2_SHIFTSDEN = 0;
+  FLEXIO1_SHIFTSDEN = 0;
   /* disable clocks for flexio and qtimer */
   CCM_CCGR5 &= ~CCM_CCGR5_FLEXIO1(CCM_CCGR_ON);
   CCM_CCGR3 &= ~CCM_CCGR3_FLEXIO2(CCM_CCGR_ON);
   CCM_CCGR6 &= ~0xC0000000;
   sei(); 
   delay(50);
-  if (gfxbufferP != NULL) free(gfxbufferP); 
+  if (gfxbufferP != NULL) mem_free(gfxbufferP); 
+  gfxbufferP = NULL;
+  gfxbuffer = NULL;
+  framebuffer = NULL;
+  gfxbuffer_size = 0;
+}
+
+// switch mode in the vertical blanking, reusing the scanout buffer
+FLASHMEM
+vga_error_t VGA_T4::setMode(vga_mode_t mode)
+{
+  ModeDef_t def;
+  if (!mode_def(mode, &def)) return(VGA_ERROR);
+  if (gfxbuffer == NULL || mode_buffer_size(&def) > gfxbuffer_size) return(VGA_ERROR);
+  end_stream();
+  // queued blits were computed for the current stride
+  blit_wait(blit_head);
+
+  // the last visible line DMAs are done once the blanking starts
+  waitLine(vblank_line);
+  cli();
+  flexio1DMA.disable();
+  flexio2DMA.disable();
+  FLEXIO1_CTRL &= ~FLEXIO_CTRL_FLEXEN;
+  FLEXIO2_CTRL &= ~FLEXIO_CTRL_FLEXEN;
+  apply_mode(&def);
+  ref_pix_shift = pix_shift;
+  config_scanout(def.flexio_clock_div);
+  FLEXIO1_CTRL = FLEXIO_CTRL_FLEXEN | FLEXIO_CTRL_FASTACC;
+  FLEXIO2_CTRL = FLEXIO_CTRL_FLEXEN | FLEXIO_CTRL_FASTACC;
+  vblank_line = TOP_BORDER + (fb_height << line_double);
+  framebuffer = (vga_pixel*)&gfxbuffer[left_border];
+  sei();
+  memset((void*)&gfxbuffer[0],0, mode_buffer_size(&def));
+  if (scale_src_width > 0) build_scaler();
+  return(VGA_OK);
 }
 
 void VGA_T4::debug()
@@ -698,25 +995,506 @@ void VGA_T4::get_frame_buffer_size(int *width, int *height)
   *height = fb_height;
 }
 
+
+/*******************************************************************
+ Memory placement of video, tile and audio buffers
+ - OCRAM : malloc in T4 heap (RAM2)
+ - DTCM  : static pool of VGA_DTCM_POOL_SIZE bytes (RAM1)
+ - EXTMEM: PSRAM of the Teensy 4.1
+ A request that cannot be honoured falls back to OCRAM, the layout
+ report shows where each buffer really landed.
+*******************************************************************/
+#define MEM_ALIGN       32
+#define MEM_MAX_BLOCKS  32
+
+#if defined(ARDUINO_TEENSY41)
+extern "C" uint8_t external_psram_size;
+#endif
+
+typedef struct {
+  void *    raw;
+  void *    ptr;
+  uint32_t  size;
+  vga_buf_t kind;
+  vga_mem_t where;
+} MemBlock_t;
+
+static vga_mem_t mem_policy[VGA_BUF_KINDS] = {VGA_MEM_OCRAM, VGA_MEM_OCRAM, VGA_MEM_OCRAM, VGA_MEM_OCRAM, VGA_MEM_OCRAM};
+static MemBlock_t mem_blocks[MEM_MAX_BLOCKS];
+static const char * mem_names[VGA_MEM_REGIONS] = {"OCRAM", "DTCM", "EXTMEM"};
+static const char * buf_names[VGA_BUF_KINDS] = {"scanout", "back", "tiles", "tilemap", "audio"};
+
+#if VGA_DTCM_POOL_SIZE > 0
+static uint8_t dtcm_pool[VGA_DTCM_POOL_SIZE] __attribute__((aligned(MEM_ALIGN)));
+#endif
+static uint32_t dtcm_used = 0;
+
+static void * dtcm_alloc(uint32_t size)
+{
+#if VGA_DTCM_POOL_SIZE > 0
+  if (dtcm_used + size <= VGA_DTCM_POOL_SIZE) {
+    void * p = &dtcm_pool[dtcm_used];
+    dtcm_used += size;
+    return p;
+  }
+#endif
+  return NULL;
+}
+
+void VGA_T4::set_memory_policy(vga_buf_t kind, vga_mem_t where)
+{
+  if (where != VGA_MEM_AUTO) mem_policy[kind] = where;
+}
+
+vga_mem_t VGA_T4::get_memory_policy(vga_buf_t kind)
+{
+  return mem_policy[kind];
+}
+
+void * VGA_T4::mem_alloc(vga_buf_t kind, size_t size, vga_mem_t where)
+{
+  int slot;
+  for (slot=0; slot<MEM_MAX_BLOCKS; slot++) {
+    if (mem_blocks[slot].ptr == NULL) break;
+  }
+  if (slot == MEM_MAX_BLOCKS) return NULL;
+
+  if (where == VGA_MEM_AUTO) where = mem_policy[kind];
+  size = (size + (MEM_ALIGN-1)) & ~(MEM_ALIGN-1);
+  void * raw = NULL;
+  void * ptr = NULL;
+
+  if (where == VGA_MEM_DTCM) {
+    ptr = dtcm_alloc(size);
+    if (ptr == NULL) where = VGA_MEM_OCRAM;
+  }
+  if (where == VGA_MEM_EXTMEM) {
+#if defined(ARDUINO_TEENSY41)
+    if (external_psram_size > 0) raw = extmem_malloc(size+MEM_ALIGN-1);
+#endif
+    if (raw == NULL) where = VGA_MEM_OCRAM;
+  }
+  if (where == VGA_MEM_OCRAM) {
+    raw = malloc(size+MEM_ALIGN-1);
+  }
+  if (raw != NULL) {
+    ptr = (void*)(((uintptr_t)raw + (MEM_ALIGN-1)) & ~(uintptr_t)(MEM_ALIGN-1));
+  }
+  if (ptr == NULL) return NULL;
+
+  mem_blocks[slot].raw = raw;
+  mem_blocks[slot].ptr = ptr;
+  mem_blocks[slot].size = size;
+  mem_blocks[slot].kind = kind;
+  mem_blocks[slot].where = where;
+  return ptr;
+}
+
+void VGA_T4::mem_free(void * p)
+{
+  for (int i=0; i<MEM_MAX_BLOCKS; i++) {
+    MemBlock_t * b = &mem_blocks[i];
+    if ( (p == NULL) || (b->ptr != p) ) continue;
+    if (b->where == VGA_MEM_DTCM) {
+#if VGA_DTCM_POOL_SIZE > 0
+      // bump pool: only the last block can be given back
+      if ((uint8_t*)b->ptr + b->size == &dtcm_pool[dtcm_used]) dtcm_used -= b->size;
+#endif
+    }
+#if defined(ARDUINO_TEENSY41)
+    else if (b->where == VGA_MEM_EXTMEM) extmem_free(b->raw);
+#endif
+    else free(b->raw);
+    b->raw = NULL;
+    b->ptr = NULL;
+    b->size = 0;
+    return;
+  }
+}
+
+uint32_t VGA_T4::get_memory_usage(vga_mem_t where)
+{
+  uint32_t total = 0;
+  for (int i=0; i<MEM_MAX_BLOCKS; i++) {
+    if ( (mem_blocks[i].ptr != NULL) && (mem_blocks[i].where == where) ) total += mem_blocks[i].size;
+  }
+  return total;
+}
+
+void VGA_T4::print_memory_layout()
+{
+  for (int i=0; i<MEM_MAX_BLOCKS; i++) {
+    MemBlock_t * b = &mem_blocks[i];
+    if (b->ptr == NULL) continue;
+    Serial.print(buf_names[b->kind]);
+    Serial.print(" @0x");
+    Serial.print((uint32_t)b->ptr, HEX);
+    Serial.print(" ");
+    Serial.print(mem_names[b->where]);
+    Serial.print(" ");
+    Serial.print(b->size);
+    Serial.println(" bytes");
+  }
+  for (int r=0; r<VGA_MEM_REGIONS; r++) {
+    Serial.print(mem_names[r]);
+    Serial.print(" total ");
+    Serial.print(get_memory_usage((vga_mem_t)r));
+    Serial.println(" bytes");
+  }
+}
+
+vga_pixel * VGA_T4::alloc_back_buffer()
+{
+  vga_pixel * buf = (vga_pixel *)mem_alloc(VGA_BUF_BACK, fb_width*fb_height*sizeof(vga_pixel));
+  if (buf != NULL) memset((void*)buf, 0, fb_width*fb_height*sizeof(vga_pixel));
+  return buf;
+}
+
+/*******************************************************************
+ Line interrupt timing
+*******************************************************************/
+void VGA_T4::get_scanout_stats(vga_scanout_stats_t * stats)
+{
+#ifdef VGA_SCANOUT_STATS
+  cli();
+  memcpy((void*)stats, (void*)&scanout_stats, sizeof(vga_scanout_stats_t));
+  sei();
+#else
+  memset((void*)stats, 0, sizeof(vga_scanout_stats_t));
+#endif
+}
+
+void VGA_T4::reset_scanout_stats()
+{
+#ifdef VGA_SCANOUT_STATS
+  cli();
+  memset((void*)&scanout_stats, 0, sizeof(scanout_stats));
+  sei();
+#endif
+}
+
+bool VGA_T4::is_line_late(int line)
+{
+#ifdef VGA_SCANOUT_STATS
+  if (line < 0 || line >= SCANOUT_LINES) return false;
+  // the map not being filled by the ISR holds the last complete frame
+  return (late_map[late_map_cur^1][line >> 5] >> (line & 31)) & 1;
+#else
+  return false;
+#endif
+}
+
+void VGA_T4::set_late_threshold(uint16_t ticks)
+{
+#ifdef VGA_SCANOUT_STATS
+  scanout_late_ticks = ticks;
+#endif
+}
+
+void VGA_T4::print_scanout_stats()
+{
+  vga_scanout_stats_t stats;
+  get_scanout_stats(&stats);
+  uint32_t ns_per_tick = 1000000000 / F_BUS_ACTUAL;
+  Serial.print("frames ");
+  Serial.print(stats.frames);
+  Serial.print(" latency ns ");
+  Serial.print(stats.lat_min*ns_per_tick);
+  Serial.print("..");
+  Serial.print(stats.lat_max*ns_per_tick);
+  Serial.print(" jitter ns ");
+  Serial.print(stats.jitter*ns_per_tick);
+  Serial.print(" (worst ");
+  Serial.print(stats.jitter_max*ns_per_tick);
+  Serial.print(") dma armed at ns ");
+  Serial.print(stats.arm_max*ns_per_tick);
+  Serial.print(" late lines ");
+  Serial.print(stats.late_lines);
+  Serial.print(" (total ");
+  Serial.print(stats.late_total);
+  Serial.println(")");
+  for (int b=0; b<SCANOUT_HIST_BINS; b++) {
+    if (stats.hist[b] == 0) continue;
+    Serial.print((b << SCANOUT_HIST_SHIFT)*ns_per_tick);
+    Serial.print("ns ");
+    Serial.println(stats.hist[b]);
+  }
+}
+
+/*******************************************************************
+ Asynchronous blitter (eDMA memory to memory)
+ One row per major loop: minor loops of at most VGA_BLIT_BURST bytes let
+ the FlexIO DMAs, which must be served every few pixels, get the engine
+ in between. The interrupt at the end of each row restarts the next one.
+*******************************************************************/
+// programs the DMA for the job at blit_tail
+FASTRUN void VGA_T4::blit_start()
+{
+  BlitJob_t * job = &blit_queue[blit_tail % VGA_BLIT_QUEUE];
+  uint32_t align = (uint32_t)job->dst | fb_stride*sizeof(vga_pixel) | job->row_bytes;
+  if (job->src != NULL) align |= (uint32_t)job->src | job->src_stride;
+  uint32_t tsize = ((align & 3) == 0) ? 2 : ((align & 1) == 0) ? 1 : 0;   // log2 of the transfer size
+  uint32_t burst = VGA_BLIT_BURST;
+  while (job->row_bytes % burst) burst >>= 1;
+
+  if (job->src == NULL) {
+#ifdef BITS12
+    blit_fill_word = job->color * 0x00010001u;
+#else
+    blit_fill_word = job->color * 0x01010101u;
+#endif
+    blitDMA.TCD->SADDR = &blit_fill_word;
+    blitDMA.TCD->SOFF = 0;
+    blitDMA.TCD->SLAST = 0;
+  }
+  else {
+    blitDMA.TCD->SADDR = job->src;
+    blitDMA.TCD->SOFF = 1 << tsize;
+    blitDMA.TCD->SLAST = job->src_stride - job->row_bytes;
+  }
+  blitDMA.TCD->ATTR = DMA_TCD_ATTR_SSIZE(tsize) | DMA_TCD_ATTR_DSIZE(tsize);
+  blitDMA.TCD->NBYTES_MLNO = burst;
+  blitDMA.TCD->DADDR = job->dst;
+  blitDMA.TCD->DOFF = 1 << tsize;
+  blitDMA.TCD->DLASTSGA = fb_stride*sizeof(vga_pixel) - job->row_bytes;
+  blitDMA.TCD->CITER_ELINKNO = job->row_bytes / burst;
+  blitDMA.TCD->BITER_ELINKNO = job->row_bytes / burst;
+  blitDMA.TCD->CSR = DMA_TCD_CSR_INTMAJOR | DMA_TCD_CSR_DREQ;
+  blit_rows_left = job->rows;
+  blit_busy = true;
+  blitDMA.enable();
+}
+
+FASTRUN void VGA_T4::BLIT_isr()
+{
+  blitDMA.clearInterrupt();
+  if (--blit_rows_left > 0) {
+    // addresses were moved to the next row by SLAST/DLASTSGA
+    blitDMA.enable();
+  }
+  else {
+    blit_tail = blit_tail + 1;
+    if (blit_tail != blit_head) blit_start();
+    else blit_busy = false;
+  }
+  asm volatile("dsb");
+}
+
+vga_fence_t VGA_T4::blit_submit(const uint8_t * src, uint32_t src_stride, uint8_t * dst, uint32_t row_bytes, uint16_t rows, vga_pixel color)
+{
+  if (!blit_ready) {
+    blitDMA.begin(true);
+    blitDMA.triggerContinuously();
+    blitDMA.attachInterrupt(BLIT_isr);
+    NVIC_SET_PRIORITY(IRQ_DMA_CH0 + (blitDMA.channel & 15), 160);
+    blit_ready = true;
+  }
+  if (row_bytes == 0 || rows == 0) return blit_head;
+  // queue full: wait for a slot
+  while (blit_head - blit_tail >= VGA_BLIT_QUEUE) {
+    asm volatile("wfi");
+  }
+  // DMA works on memory: write back what the CPU drew, drop stale destination lines
+  uint32_t dst_span = (rows-1)*fb_stride*sizeof(vga_pixel) + row_bytes;
+  if (src != NULL) arm_dcache_flush((void*)src, (rows-1)*src_stride + row_bytes);
+  arm_dcache_flush_delete((void*)dst, dst_span);
+
+  BlitJob_t * job = &blit_queue[blit_head % VGA_BLIT_QUEUE];
+  job->src = src;
+  job->dst = dst;
+  job->src_stride = src_stride;
+  job->row_bytes = row_bytes;
+  job->rows = rows;
+  job->color = color;
+  int irq = IRQ_DMA_CH0 + (blitDMA.channel & 15);
+  NVIC_DISABLE_IRQ(irq);
+  blit_head = blit_head + 1;
+  if (!blit_busy) blit_start();
+  NVIC_ENABLE_IRQ(irq);
+  return blit_head;
+}
+
+vga_fence_t VGA_T4::blit_fill(int x, int y, int w, int h, vga_pixel color)
+{
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > fb_width) w = fb_width - x;
+  if (y + h > fb_height) h = fb_height - y;
+  if (w <= 0 || h <= 0) return blit_head;
+  return blit_submit(NULL, 0, (uint8_t*)&framebuffer[y*fb_stride+x], w*sizeof(vga_pixel), h, color);
+}
+
+vga_fence_t VGA_T4::blit_copy(const vga_pixel * src, int src_stride, int x, int y, int w, int h)
+{
+  if (x < 0) { src -= x; w += x; x = 0; }
+  if (y < 0) { src -= y*src_stride; h += y; y = 0; }
+  if (x + w > fb_width) w = fb_width - x;
+  if (y + h > fb_height) h = fb_height - y;
+  if (w <= 0 || h <= 0) return blit_head;
+  return blit_submit((const uint8_t*)src, src_stride*sizeof(vga_pixel), (uint8_t*)&framebuffer[y*fb_stride+x], w*sizeof(vga_pixel), h, 0);
+}
+
+vga_fence_t VGA_T4::blit_clear(vga_pixel color)
+{
+  return blit_fill(0, 0, fb_width, fb_height, color);
+}
+
+vga_fence_t VGA_T4::blit_buffer(const vga_pixel * back)
+{
+  return blit_copy(back, fb_width, 0, 0, fb_width, fb_height);
+}
+
+bool VGA_T4::blit_done(vga_fence_t fence)
+{
+  return (int32_t)(blit_tail - fence) >= 0;
+}
+
+void VGA_T4::blit_wait(vga_fence_t fence)
+{
+  while (!blit_done(fence)) {
+    asm volatile("wfi");
+  }
+}
+
+/*******************************************************************
+ Raster callbacks and waits
+*******************************************************************/
+void VGA_T4::set_vblank_callback(vga_raster_callback_t callback, bool deferred)
+{
+  cli();
+  vblank_callback = callback;
+  vblank_deferred = deferred;
+  sei();
+}
+
+int VGA_T4::add_line_callback(int line, vga_raster_callback_t callback, bool deferred)
+{
+  if (line < 0 || line >= 525) return -1;
+  cli();
+  for (int i=0; i<VGA_LINE_CALLBACKS; i++) {
+    if (i == nb_line_callbacks || line_callbacks[i].callback == NULL) {
+      line_callbacks[i].line     = line;
+      line_callbacks[i].deferred = deferred;
+      line_callbacks[i].callback = callback;
+      if (i == nb_line_callbacks) nb_line_callbacks++;
+      sei();
+      return i;
+    }
+  }
+  sei();
+  return -1;
+}
+
+void VGA_T4::remove_line_callback(int id)
+{
+  if (id < 0 || id >= nb_line_callbacks) return;
+  cli();
+  line_callbacks[id].callback = NULL;
+  while (nb_line_callbacks > 0 && line_callbacks[nb_line_callbacks-1].callback == NULL) nb_line_callbacks--;
+  sei();
+}
+
+uint32_t VGA_T4::get_frame_count()
+{
+  return frame_count;
+}
+
+int VGA_T4::get_beam_row()
+{
+  int line = currentLine;
+  return (line - TOP_BORDER) >> line_double;
+}
+
+// the line interrupt wakes the core up from WFI every line
 void VGA_T4::waitSync()
 {
-  while (VSYNC == 0) {};
+  PROFILE_START(wait_start);
+  uint32_t frame = frame_count;
+  while (frame_count == frame) {
+    asm volatile("wfi");
+  }
+  PROFILE_STOP(wait_start, PROF_WAIT);
 }
 
+// flagged by QT3_isr, so the line cannot be missed by a late poll
 void VGA_T4::waitLine(int line)
 {
-  while (currentLine != (unsigned)line) {};
+  PROFILE_START(wait_start);
+  wait_line_hit = false;
+  wait_line = line;
+  while (!wait_line_hit) {
+    asm volatile("wfi");
+  }
+  wait_line = 0xffffffff;
+  PROFILE_STOP(wait_start, PROF_WAIT);
+}
+
+/*******************************************************************
+ Pixel format primitives, specialized on the vga_format traits
+ (pixfmt.h): word wide inner loops for 8 and 16 bits pixels
+*******************************************************************/
+// pixel replicated over a 32 bits word
+template <class F> static inline uint32_t pix_word(typename F::pixel p)
+{
+  return (sizeof(typename F::pixel) == 1) ? p * 0x01010101u : p * 0x00010001u;
+}
+
+template <class F> static void pix_fill(typename F::pixel * dst, typename F::pixel color, int n)
+{
+  while ( (n > 0) && ((uint32_t)dst & 3) ) {
+    *dst++ = color;
+    n--;
+  }
+  const int per_word = 4 / sizeof(typename F::pixel);
+  uint32_t word = pix_word<F>(color);
+  uint32_t * d = (uint32_t *)dst;
+  for (; n >= per_word; n -= per_word) *d++ = word;
+  dst = (typename F::pixel *)d;
+  while (n-- > 0) *dst++ = color;
+}
+
+template <class F> static void pix_copy(typename F::pixel * dst, const typename F::pixel * src, int n)
+{
+  memcpy((void*)dst, (const void*)src, n*sizeof(typename F::pixel));
+}
+
+// skips transparent pixels, a word at a time when all opaque or all transparent
+template <class F> static void pix_copy_trans(typename F::pixel * dst, const typename F::pixel * src, int n)
+{
+  const int per_word = 4 / sizeof(typename F::pixel);
+  if ( (((uint32_t)dst | (uint32_t)src) & 3) == 0 ) {
+    uint32_t mask = pix_word<F>(F::trans_mask);
+    for (; n >= per_word; n -= per_word) {
+      uint32_t w = *(const uint32_t *)src;
+      uint32_t t = w & mask;
+      if (t == 0) *(uint32_t *)dst = w;
+      else if (t != mask) {
+        for (int i=0; i<per_word; i++) if (!F::transparent(src[i])) dst[i] = src[i];
+      }
+      dst += per_word;
+      src += per_word;
+    }
+  }
+  while (n-- > 0) {
+    if (!F::transparent(*src)) *dst = *src;
+    dst++;
+    src++;
+  }
+}
+
+// FlexIO1 bits from src, FlexIO2 bits from src2 (DMAs shifted by pix_shift)
+template <class F> static void pix_merge(typename F::pixel * dst, const typename F::pixel * src, const typename F::pixel * src2, int n, int repeat)
+{
+  for (int i=0; i<n; i++) {
+    typename F::pixel p = (*src++ & F::flexio1_mask) | (*src2++ & F::flexio2_mask);
+    for (int r=0; r<repeat; r++) *dst++ = p;
+  }
 }
 
 void VGA_T4::clear(vga_pixel color) {
-  int i,j;
-  for (j=0; j<fb_height; j++)
+  for (int j=0; j<fb_height; j++)
   {
-    vga_pixel * dst=&framebuffer[j*fb_stride];
-    for (i=0; i<fb_width; i++)
-    {
-      *dst++ = color;
-    }
+    pix_fill<vga_format>(&framebuffer[j*fb_stride], color, fb_width);
   }
 }
 
@@ -881,7 +1659,351 @@ void VGA_T4::drawText(int16_t x, int16_t y, const char * text, vga_pixel fgcolor
 //  } 
 //}
 
-void VGA_T4::writeLine(int width, int height, int y, uint8_t *buf, vga_pixel *palette) {
+/*******************************************************************
+ Scaler: writeLine/writeScreen of a fixed source size to any mode
+ Column and row tables are built once per source size and mode,
+ each line is then a table driven gather, duplicated to the extra
+ rows when stretching vertically (or dropped when shrinking).
+ SCALE_FILTER gathers 2 columns per pixel and averages them, both
+ are the same column unless the sample falls between two pixels.
+*******************************************************************/
+static vga_scale_t scale_filter = SCALE_NEAREST;
+static uint16_t    scale_col0[VGA_SCALE_MAX];
+static uint16_t    scale_col1[VGA_SCALE_MAX];
+static uint16_t    scale_row[VGA_SCALE_MAX+1];   // first screen row of each source row
+
+static FLASHMEM void build_scaler()
+{
+  int sw = scale_src_width;
+  int sh = scale_src_height;
+  for (int i=0; i<fb_width; i++)
+  {
+    // sample position of the pixel center in 16.16 source pixels, minus half a pixel
+    int32_t pos = (int32_t)(((uint64_t)(2*i+1)*sw << 15) / fb_width) - 0x8000;
+    int left = pos < 0 ? 0 : (pos >> 16);
+    int frac = pos < 0 ? 0 : (pos & 0xffff);
+    int right = (left+1 < sw) ? left+1 : left;
+    if (scale_filter == SCALE_FILTER && frac >= 0x4000 && frac < 0xc000) {
+      scale_col0[i] = left;
+      scale_col1[i] = right;
+    }
+    else {
+      scale_col0[i] = scale_col1[i] = (frac < 0x8000) ? left : right;
+    }
+  }
+  int j = 0;
+  for (int r=0; r<fb_height; r++)
+  {
+    int src = (int)(((uint64_t)(2*r+1)*sh) / (2*fb_height));
+    while (j <= src) scale_row[j++] = r;
+  }
+  while (j <= sh) scale_row[j++] = fb_height;
+}
+
+void VGA_T4::set_scaler(int src_width, int src_height, vga_scale_t filter)
+{
+  if (src_height > VGA_SCALE_MAX) src_width = src_height = 0;
+  scale_src_width = src_width;
+  scale_src_height = src_height;
+  scale_filter = filter;
+  if (src_width > 0) build_scaler();
+}
+
+// first row of a source line, NULL if it is dropped or out of the source
+static inline vga_pixel * scale_dst(int y, int * rows)
+{
+  if (y < 0 || y >= scale_src_height) return NULL;
+  *rows = scale_row[y+1] - scale_row[y];
+  if (*rows <= 0) return NULL;
+  return &framebuffer[scale_row[y]*fb_stride];
+}
+
+static inline void scale_dup(vga_pixel * dst, int rows)
+{
+  for (int r=1; r<rows; r++)
+    memcpy(&dst[r*fb_stride], dst, fb_width*sizeof(vga_pixel));
+}
+
+// P: vga_pixel, or a paired palette entry whose low pixel is the color
+template <class P> static void scale_gather(vga_pixel * dst, const uint8_t * src, const P * palette)
+{
+  if (scale_filter == SCALE_FILTER) {
+    for (int i=0; i<fb_width; i++)
+    {
+      vga_pixel a = (vga_pixel)palette[src[scale_col0[i]]];
+      vga_pixel b = (vga_pixel)palette[src[scale_col1[i]]];
+      dst[i] = VGA_AVG(a,b);
+    }
+  }
+  else {
+    int i = 0;
+    for (; i<fb_width-3; i+=4)
+    {
+      dst[i]   = (vga_pixel)palette[src[scale_col0[i]]];
+      dst[i+1] = (vga_pixel)palette[src[scale_col0[i+1]]];
+      dst[i+2] = (vga_pixel)palette[src[scale_col0[i+2]]];
+      dst[i+3] = (vga_pixel)palette[src[scale_col0[i+3]]];
+    }
+    for (; i<fb_width; i++) dst[i] = (vga_pixel)palette[src[scale_col0[i]]];
+  }
+}
+
+static void scale_gather(vga_pixel * dst, const vga_pixel * src)
+{
+  if (scale_filter == SCALE_FILTER) {
+    for (int i=0; i<fb_width; i++)
+    {
+      vga_pixel a = src[scale_col0[i]];
+      vga_pixel b = src[scale_col1[i]];
+      dst[i] = VGA_AVG(a,b);
+    }
+  }
+  else {
+    int i = 0;
+    for (; i<fb_width-3; i+=4)
+    {
+      dst[i]   = src[scale_col0[i]];
+      dst[i+1] = src[scale_col0[i+1]];
+      dst[i+2] = src[scale_col0[i+2]];
+      dst[i+3] = src[scale_col0[i+3]];
+    }
+    for (; i<fb_width; i++) dst[i] = src[scale_col0[i]];
+  }
+}
+
+template <class P> static void scale_line(int y, const uint8_t * src, const P * palette)
+{
+  int rows;
+  vga_pixel * dst = scale_dst(y, &rows);
+  if (dst == NULL) return;
+  scale_gather(dst, src, palette);
+  scale_dup(dst, rows);
+}
+
+static void scale_line(int y, const vga_pixel * src)
+{
+  int rows;
+  vga_pixel * dst = scale_dst(y, &rows);
+  if (dst == NULL) return;
+  scale_gather(dst, src);
+  scale_dup(dst, rows);
+}
+
+
+/*******************************************************************
+ Line streaming: source lines pushed in beam order are converted and
+ scaled by the software interrupt into a ring of VGA_STREAM_LINES
+ DMA line buffers, just ahead of the beam. A line buffer is reused
+ once the beam has left its previous source row, the line interrupt
+ points the pixel DMAs at it (or at the framebuffer row if the line
+ did not make it in time).
+*******************************************************************/
+static uint8_t           stream_format;
+static const vga_pixel * stream_palette;
+static vga_pixel         stream_tmp[VGA_SCALE_MAX];
+
+static void stream_service()
+{
+  while (stream_tail != stream_head) {
+    StreamLine_t * l = &stream_queue[stream_tail % VGA_STREAM_QUEUE];
+    int src = l->y;
+    int beam = stream_beam;
+    if (beam >= 0) {
+      if (src < beam) {
+        // far behind the beam: next frame, wait for the blanking
+        if (beam - src > scale_src_height/2) break;
+        stream_late++;
+        stream_tail = stream_tail + 1;
+        continue;
+      }
+      // its line buffer still holds a row not scanned yet
+      if (src >= beam + VGA_STREAM_LINES) break;
+    }
+    else if (src >= VGA_STREAM_LINES) break;
+
+    int slot = src & (VGA_STREAM_LINES-1);
+    stream_tag[slot] = -1;
+    vga_pixel * dst = &stream_buffer[slot*fb_stride+left_border];
+    if (stream_format == STREAM_INDEXED) {
+      scale_gather(dst, (const uint8_t *)l->line, stream_palette);
+    }
+    else if (stream_format == STREAM_RGB565) {
+      Convert::rgb565((const uint16_t *)l->line, stream_tmp, scale_src_width);
+      scale_gather(dst, stream_tmp);
+    }
+    else {
+      scale_gather(dst, (const vga_pixel *)l->line);
+    }
+    arm_dcache_flush((void*)dst, fb_width*sizeof(vga_pixel));
+    stream_tag[slot] = src;
+    stream_tail = stream_tail + 1;
+  }
+}
+
+vga_error_t VGA_T4::begin_stream(int src_width, int src_height, vga_stream_fmt_t format, const vga_pixel *palette, vga_scale_t filter)
+{
+  if (src_width <= 0 || src_width > VGA_SCALE_MAX || src_height <= 0 || src_height > VGA_SCALE_MAX) return(VGA_ERROR);
+  if (format == STREAM_INDEXED && palette == NULL) return(VGA_ERROR);
+  end_stream();
+  uint32_t size = VGA_STREAM_LINES*fb_stride*sizeof(vga_pixel)+4; // 4bytes for pixel shift
+  stream_buffer = (vga_pixel *)mem_alloc(VGA_BUF_SCANOUT, size);
+  if (stream_buffer == NULL) return(VGA_ERROR);
+  memset((void*)stream_buffer, 0, size);
+  set_scaler(src_width, src_height, filter);
+  for (int r=0; r<fb_height; r++)
+  {
+    stream_src_row[r] = (uint16_t)(((uint64_t)(2*r+1)*src_height) / (2*fb_height));
+  }
+  for (int i=0; i<VGA_STREAM_LINES; i++) stream_tag[i] = -1;
+  stream_format = format;
+  stream_palette = palette;
+  stream_head = stream_tail = 0;
+  stream_late = stream_missing = 0;
+  stream_active = true;
+  return(VGA_OK);
+}
+
+void VGA_T4::end_stream()
+{
+  if (stream_buffer == NULL) return;
+  stream_active = false;
+  // the pixel DMAs are done with the line buffers in the blanking
+  // (no wait once the scanout is stopped, the line interrupt is gone)
+  if (gfxbuffer != NULL) waitLine(vblank_line);
+  mem_free(stream_buffer);
+  stream_buffer = NULL;
+  stream_head = stream_tail = 0;
+  stream_beam = -1;
+}
+
+bool VGA_T4::stream_line(int y, const void *line)
+{
+  if (!stream_active || y < 0 || y >= scale_src_height) return false;
+  if (stream_head - stream_tail >= VGA_STREAM_QUEUE) return false;
+  StreamLine_t * l = &stream_queue[stream_head % VGA_STREAM_QUEUE];
+  l->line = line;
+  l->y = y;
+  stream_barrier();
+  stream_head = stream_head + 1;
+  raise_software(SW_STREAM);
+  return true;
+}
+
+int VGA_T4::stream_pending()
+{
+  return stream_head - stream_tail;
+}
+
+void VGA_T4::get_stream_stats(uint32_t *late, uint32_t *missing)
+{
+  *late = stream_late;
+  *missing = stream_missing;
+}
+
+/*******************************************************************
+ Paired pixel palettes: 2x / 4x horizontal expansion with one
+ halfword / word store per source pixel instead of 2 / 4 pixel stores
+*******************************************************************/
+#ifdef BITS12
+#define PIXEL_PAIR(v)  ((vga_pixel2)(v) * 0x00010001)
+#define PIXEL_QUAD(v)  ((vga_pixel4)(v) * 0x0001000100010001ULL)
+#else
+#define PIXEL_PAIR(v)  ((vga_pixel2)(v) * 0x0101)
+#define PIXEL_QUAD(v)  ((vga_pixel4)(v) * 0x01010101)
+#endif
+
+// pair / quad of a source index: from a paired palette, or replicated
+// from a plain one (one multiply, only the indices present are read)
+template <class P> struct PairOf {
+  const P * palette;
+  inline vga_pixel2 operator()(uint8_t i) const { return (vga_pixel2)palette[i]; }
+};
+template <> struct PairOf<vga_pixel> {
+  const vga_pixel * palette;
+  inline vga_pixel2 operator()(uint8_t i) const { return PIXEL_PAIR(palette[i]); }
+};
+struct QuadOf {
+  const vga_pixel4 * palette;
+  inline vga_pixel4 operator()(uint8_t i) const { return palette[i]; }
+};
+
+void VGA_T4::expand_palette2x(const vga_pixel *palette, vga_pixel2 *palette2x, int count)
+{
+  for (int i=0; i<count; i++) palette2x[i] = PIXEL_PAIR(palette[i]);
+}
+
+void VGA_T4::expand_palette4x(const vga_pixel *palette, vga_pixel4 *palette4x, int count)
+{
+  for (int i=0; i<count; i++) palette4x[i] = PIXEL_QUAD(palette[i]);
+}
+
+template <class L> static void expand_line2x(vga_pixel * dst, const uint8_t * src, int width, L pair)
+{
+  if ((uint32_t)dst & 3) {
+    // unaligned line (odd left border), pixel stores
+    while (width-- > 0) {
+      vga_pixel val = (vga_pixel)pair(*src++);
+      *dst++ = val;
+      *dst++ = val;
+    }
+    return;
+  }
+  // 4 source pixels per iteration
+#ifdef BITS12
+  vga_pixel2 * d = (vga_pixel2 *)dst;
+  for (; width >= 4; width -= 4) {
+    d[0] = pair(src[0]);
+    d[1] = pair(src[1]);
+    d[2] = pair(src[2]);
+    d[3] = pair(src[3]);
+    d += 4;
+    src += 4;
+  }
+#else
+  uint32_t * d32 = (uint32_t *)dst;
+  for (; width >= 4; width -= 4) {
+    d32[0] = pair(src[0]) | ((uint32_t)pair(src[1]) << 16);
+    d32[1] = pair(src[2]) | ((uint32_t)pair(src[3]) << 16);
+    d32 += 2;
+    src += 4;
+  }
+  vga_pixel2 * d = (vga_pixel2 *)d32;
+#endif
+  while (width-- > 0) *d++ = pair(*src++);
+}
+
+template <class L> static void expand_line4x(vga_pixel * dst, const uint8_t * src, int width, L quad)
+{
+  if ((uint32_t)dst & 3) {
+    while (width-- > 0) {
+      vga_pixel val = (vga_pixel)quad(*src++);
+      *dst++ = val;
+      *dst++ = val;
+      *dst++ = val;
+      *dst++ = val;
+    }
+    return;
+  }
+  vga_pixel4 * d = (vga_pixel4 *)dst;
+  for (; width >= 4; width -= 4) {
+    d[0] = quad(src[0]);
+    d[1] = quad(src[1]);
+    d[2] = quad(src[2]);
+    d[3] = quad(src[3]);
+    d += 4;
+    src += 4;
+  }
+  while (width-- > 0) *d++ = quad(*src++);
+}
+
+// indexed line for every palette kind: scaler, downscale, 2x expansion
+// with pair stores, centered copy
+template <class P> static void write_indexed(int width, int height, int y, uint8_t *buf, const P *palette)
+{
+  if ( (width == scale_src_width) && (height == scale_src_height) ) {
+    scale_line(y, buf, palette);
+    return;
+  }
   if ( (height<fb_height) && (height > 2) ) y += (fb_height-height)/2;
   vga_pixel * dst=&framebuffer[y*fb_stride];
   if (width > fb_width) {
@@ -890,11 +2012,11 @@ void VGA_T4::writeLine(int width, int height, int y, uint8_t *buf, vga_pixel *pa
     int pos = delta;
     for (int i=0; i<fb_width; i++)
     {
-      uint16_t val = palette[*buf++];
+      uint16_t val = (vga_pixel)palette[*buf++];
       pos--;
       if (pos == 0) {
 #ifdef LINEARINT_HACK
-        val  = ((uint32_t)palette[*buf++] + val)/2;
+        val  = ((uint32_t)(vga_pixel)palette[*buf++] + val)/2;
 #else
         uint16_t val2 = *buf++;
         val = RGBVAL16((R16(val)+R16(val2))/2,(G16(val)+G16(val2))/2,(B16(val)+B16(val2))/2);
@@ -908,32 +2030,49 @@ void VGA_T4::writeLine(int width, int height, int y, uint8_t *buf, vga_pixel *pa
     int pos = 0;
     for (int i=0; i<fb_width; i++)
     {
-      *dst++=palette[buf[pos >> 8]];
+      *dst++=(vga_pixel)palette[buf[pos >> 8]];
       pos +=step;
     }  
 #endif
   }
   else if ((width*2) == fb_width) {
-    for (int i=0; i<width; i++)
-    {
-      *dst++=palette[*buf];
-      *dst++=palette[*buf++];
-    } 
+    PairOf<P> pair = { palette };
+    expand_line2x(dst, buf, width, pair);
   }
   else {
-    if (width <= fb_width) {
-      dst += (fb_width-width)/2;
-    }
+    dst += (fb_width-width)/2;
     for (int i=0; i<width; i++)
     {
-      *dst++=palette[*buf++];
+      *dst++=(vga_pixel)palette[*buf++];
     } 
   }
 }
 
+void VGA_T4::writeLine(int width, int height, int y, uint8_t *buf, const vga_pixel2 *palette2x) {
+  write_indexed(width, height, y, buf, palette2x);
+}
+
+void VGA_T4::writeLine(int width, int height, int y, uint8_t *buf, const vga_pixel4 *palette4x) {
+  if ( ((width*4) == fb_width) && !((width == scale_src_width) && (height == scale_src_height)) ) {
+    if ( (height<fb_height) && (height > 2) ) y += (fb_height-height)/2;
+    QuadOf quad = { palette4x };
+    expand_line4x(&framebuffer[y*fb_stride], buf, width, quad);
+    return;
+  }
+  write_indexed(width, height, y, buf, palette4x);
+}
+
+void VGA_T4::writeLine(int width, int height, int y, uint8_t *buf, vga_pixel *palette) {
+  write_indexed(width, height, y, buf, (const vga_pixel *)palette);
+}
+
 void VGA_T4::writeLine(int width, int height, int y, vga_pixel *buf) {
+  if ( (width == scale_src_width) && (height == scale_src_height) ) {
+    scale_line(y, buf);
+    return;
+  }
   if ( (height<fb_height) && (height > 2) ) y += (fb_height-height)/2;
-  uint8_t * dst=&framebuffer[y*fb_stride];    
+  vga_pixel * dst=&framebuffer[y*fb_stride];    
   if (width > fb_width) {
     int step = ((width << 8)/fb_width);
     int pos = 0;
@@ -945,12 +2084,7 @@ void VGA_T4::writeLine(int width, int height, int y, vga_pixel *buf) {
   }
   else if ((width*2) == fb_width) {
     if ( ( !(pix_shift & DMA_HACK) ) && (pix_shift & 0x3) ) {
-      vga_pixel *buf2 = buf + (pix_shift & 0x3);
-      for (int i=0; i<width; i++)
-      {
-        *dst++ = (*buf & 0xf0) | (*buf2 & 0x0f);
-        *dst++ = (*buf++ & 0xf0) | (*buf2++ & 0x0f);
-      }
+      pix_merge<vga_format>(dst, buf, buf + (pix_shift & 0x3), width, 2);
     }  
     else {
       for (int i=0; i<width; i++)
@@ -965,52 +2099,87 @@ void VGA_T4::writeLine(int width, int height, int y, vga_pixel *buf) {
       dst += (fb_width-width)/2;
     }
     if ( ( !(pix_shift & DMA_HACK) ) && (pix_shift & 0x3) ) {
-      vga_pixel *buf2 = buf + (pix_shift & 0x3);
-      for (int i=0; i<width; i++)
-      {
-        *dst++ = (*buf++ & 0xf0) | (*buf2++ & 0x0f);
-      }
+      pix_merge<vga_format>(dst, buf, buf + (pix_shift & 0x3), width, 1);
     }  
     else {
-      for (int i=0; i<width; i++)
+      pix_copy<vga_format>(dst, buf, width);
+    }
+  }
+}
+
+void VGA_T4::writeLine16(int width, int height, int y, uint16_t *buf, bool dither) {
+  if ( (height<fb_height) && (height > 2) ) y += (fb_height-height)/2;
+  vga_pixel * dst=&framebuffer[y*fb_stride];    
+  if (width > fb_width) {
+    int step = ((width << 8)/fb_width);
+    int pos = 0;
+    for (int i=0; i<fb_width; i++)
+    {
+      *dst++ = Convert::pixel565(buf[pos >> 8]); 
+      pos +=step;
+    }        
+  }
+  else if ((width*2) == fb_width) {
+    // convert in chunks, then double
+    vga_pixel line[64] __attribute__((aligned(4)));
+    for (int x=0; x<width; x+=64)
+    {
+      int n = (width-x) < 64 ? (width-x) : 64;
+      if (dither) Convert::rgb565_dither(buf+x, line, n, x, y);
+      else Convert::rgb565(buf+x, line, n);
+      for (int i=0; i<n; i++)
       {
-        *dst++=*buf++;
+        vga_pixel col = line[i];
+        *dst++= col;
+        *dst++= col;
       }
+    }       
+  }
+  else {
+    int x = 0;
+    if (width <= fb_width) {
+      x = (fb_width-width)/2;
     }
+    if (dither) Convert::rgb565_dither(buf, dst+x, width, x, y);
+    else Convert::rgb565(buf, dst+x, width);
   }
 }
 
-void VGA_T4::writeLine16(int width, int height, int y, uint16_t *buf) {
+void VGA_T4::writeLine24(int width, int height, int y, uint8_t *buf, bool dither) {
   if ( (height<fb_height) && (height > 2) ) y += (fb_height-height)/2;
-  uint8_t * dst=&framebuffer[y*fb_stride];    
+  vga_pixel * dst=&framebuffer[y*fb_stride];    
   if (width > fb_width) {
     int step = ((width << 8)/fb_width);
     int pos = 0;
     for (int i=0; i<fb_width; i++)
     {
-      uint16_t pix = buf[pos >> 8];
-      *dst++ = VGA_RGB(R16(pix),G16(pix),B16(pix)); 
+      uint8_t * pix = &buf[(pos >> 8)*3];
+      *dst++ = VGA_RGB(pix[0],pix[1],pix[2]); 
       pos +=step;
     }        
   }
   else if ((width*2) == fb_width) {
-    for (int i=0; i<width; i++)
+    vga_pixel line[64] __attribute__((aligned(4)));
+    for (int x=0; x<width; x+=64)
     {
-      uint16_t pix = *buf++;
-      uint8_t col = VGA_RGB(R16(pix),G16(pix),B16(pix));
-      *dst++= col;
-      *dst++= col;
+      int n = (width-x) < 64 ? (width-x) : 64;
+      if (dither) Convert::rgb888_dither(buf+x*3, line, n, x, y);
+      else Convert::rgb888(buf+x*3, line, n);
+      for (int i=0; i<n; i++)
+      {
+        vga_pixel col = line[i];
+        *dst++= col;
+        *dst++= col;
+      }
     }       
   }
   else {
+    int x = 0;
     if (width <= fb_width) {
-      dst += (fb_width-width)/2;
+      x = (fb_width-width)/2;
     }
-    for (int i=0; i<width; i++)
-    {
-      uint16_t pix = *buf++;
-      *dst++=VGA_RGB(R16(pix),G16(pix),B16(pix));
-    }      
+    if (dither) Convert::rgb888_dither(buf, dst+x, width, x, y);
+    else Convert::rgb888(buf, dst+x, width);
   }
 }
 
@@ -1019,27 +2188,22 @@ void VGA_T4::writeScreen(int width, int height, int stride, uint8_t *buf, vga_pi
   uint8_t *src; 
 
   int i,j,y=0;
-  if (width*2 <= fb_width) {
+  if ( (width == scale_src_width) && (height == scale_src_height) ) {
+    for (j=0; j<height; j++)
+    {
+      scale_line(j, buffer, palette);
+      buffer += stride;
+    }
+  }
+  else if (width*2 <= fb_width) {
+    PairOf<vga_pixel> pair = { palette };
     for (j=0; j<height; j++)
     {
       vga_pixel * dst=&framebuffer[y*fb_stride];
-      src=buffer;
-      for (i=0; i<width; i++)
-      {
-        vga_pixel val = palette[*src++];
-        *dst++ = val;
-        *dst++ = val;
-      }
+      expand_line2x(dst, buffer, width, pair);
       y++;
       if (height*2 <= fb_height) {
-        dst=&framebuffer[y*fb_stride];    
-        src=buffer;
-        for (i=0; i<width; i++)
-        {
-          vga_pixel val = palette[*src++];
-          *dst++ = val;
-          *dst++ = val;
-        }
+        memcpy(&framebuffer[y*fb_stride], dst, width*2*sizeof(vga_pixel));
         y++;
       } 
       buffer += stride;
@@ -1077,9 +2241,9 @@ void VGA_T4::copyLine(int width, int height, int ysrc, int ydst) {
     ysrc += (fb_height-height)/2;
     ydst += (fb_height-height)/2;
   }    
-  uint8_t * src=&framebuffer[ysrc*fb_stride];    
-  uint8_t * dst=&framebuffer[ydst*fb_stride]; 
-  memcpy(dst,src,width);   
+  vga_pixel * src=&framebuffer[ysrc*fb_stride];    
+  vga_pixel * dst=&framebuffer[ydst*fb_stride]; 
+  pix_copy<vga_format>(dst,src,width);   
 } 
 
 
@@ -1715,7 +2879,7 @@ static int hscr_mask=0;
 
 void VGA_T4::drawBitmap(vga_pixel* _pixels, uint8_t _bitmap_size_px, int16_t _x, int16_t _y, 
                         uint16_t _crop_top, uint16_t _crop_bottom, uint16_t _crop_left, uint16_t _crop_right, 
-                        bool _log, bool _render, bool trans) {
+                        bool _render, bool trans) {
 
   if ((_x > _crop_right) || (_y > _crop_bottom)) {
     return;
@@ -1727,22 +2891,9 @@ void VGA_T4::drawBitmap(vga_pixel* _pixels, uint8_t _bitmap_size_px, int16_t _x,
   uint8_t end_row   = (_y + _bitmap_size_px > _crop_bottom) ? _crop_bottom - _y + 1 : _bitmap_size_px;
 
   for (uint8_t row=start_row; row < end_row; row++) {
-    if(_log) {
-      Serial.print(" _y+row=");
-      Serial.println(_y+row);
-      Serial.print(" _x=");
-      Serial.print(_x);
-      Serial.print(" _crop_right=");
-      Serial.print(_crop_right);
-      Serial.print(" end_col=");
-      Serial.println(end_col);
-    }
+    TRACE_VERBOSE(TRACE_BITMAP_ROW, _y+row, _x, _crop_right, end_col);
     if (_y+row>_crop_bottom) { 
-      if(_log) {
-        Serial.print(">crop_bottom (");
-        Serial.print(_crop_bottom);
-        Serial.println("), breaking");
-      }
+      TRACE_VERBOSE(TRACE_BITMAP_CROP, _crop_bottom);
       break;
     }
 
@@ -1750,17 +2901,104 @@ void VGA_T4::drawBitmap(vga_pixel* _pixels, uint8_t _bitmap_size_px, int16_t _x,
     vga_pixel* src = &_pixels[row * _bitmap_size_px + start_col];
 
     if (trans) {
-      for (uint8_t col=start_col; col < end_col; col++) { 
-        if (((*src)&128) != 128) {
-          *dst = *src;
-        }
-        dst++;
-        src++;
-      }
+      pix_copy_trans<vga_format>(dst, src, end_col-start_col);
     }
     else { 
-      for (uint8_t col=start_col; col < end_col; col++) { 
-          *dst++ = *src++;
+      pix_copy<vga_format>(dst, src, end_col-start_col);
+    }
+  }
+}
+
+
+/*******************************************************************
+ Blended bitmaps
+ With 8 bits pixels every mode is a table: shadow maps the
+ destination (256 entries), add and half map source*256+destination
+ (64KB each), so the inner loop is one table read per pixel.
+*******************************************************************/
+template <class F> static typename F::pixel blend_pixel(int mode, typename F::pixel s, typename F::pixel d)
+{
+  uint8_t rs, gs, bs, rd, gd, bd;
+  F::decode(s, &rs, &gs, &bs);
+  F::decode(d, &rd, &gd, &bd);
+  switch (mode) {
+    case BLEND_SHADOW:
+      return F::rgb(rd >> 1, gd >> 1, bd >> 1);
+    case BLEND_ADD:
+      return F::rgb(rs+rd > 255 ? 255 : rs+rd, gs+gd > 255 ? 255 : gs+gd, bs+bd > 255 ? 255 : bs+bd);
+    case BLEND_HALF:
+      return F::rgb((rs+rd) >> 1, (gs+gd) >> 1, (bs+bd) >> 1);
+    default:
+      return s;
+  }
+}
+
+#ifndef BITS12
+static uint8_t   blend_shadow[256];
+static uint8_t * blend_lut[VGA_BLEND_MODES] = { NULL, NULL, NULL, NULL };
+#endif
+
+vga_error_t VGA_T4::init_blend(vga_blend_t mode)
+{
+#ifndef BITS12
+  if (mode == BLEND_NONE || blend_lut[mode] != NULL) return(VGA_OK);
+  if (mode == BLEND_SHADOW) {
+    for (int d=0; d<256; d++) blend_shadow[d] = blend_pixel<vga_format>(mode, 0, d);
+    blend_lut[mode] = blend_shadow;
+    return(VGA_OK);
+  }
+  uint8_t * lut = (uint8_t *)mem_alloc(VGA_BUF_TILES, 256*256);
+  if (lut == NULL) return(VGA_ERROR);
+  for (int s=0; s<256; s++)
+    for (int d=0; d<256; d++)
+      lut[(s<<8)|d] = blend_pixel<vga_format>(mode, s, d);
+  blend_lut[mode] = lut;
+#endif
+  return(VGA_OK);
+}
+
+void VGA_T4::blendBitmap(vga_pixel* _pixels, uint8_t _bitmap_size_px, int16_t _x, int16_t _y, 
+                         uint16_t _crop_top, uint16_t _crop_bottom, uint16_t _crop_left, uint16_t _crop_right, 
+                         vga_blend_t _mode) {
+  if ((_x > _crop_right) || (_y > _crop_bottom)) {
+    return;
+  }
+
+  uint8_t start_col = (_x < _crop_left) ? _crop_left - _x : 0;
+  uint8_t start_row = (_y < _crop_top)  ? _crop_top  - _y : 0;
+  uint8_t end_col   = (_x + _bitmap_size_px > _crop_right)  ? _crop_right  - _x + 1 : _bitmap_size_px;
+  uint8_t end_row   = (_y + _bitmap_size_px > _crop_bottom) ? _crop_bottom - _y + 1 : _bitmap_size_px;
+
+#ifndef BITS12
+  if (_mode != BLEND_NONE && blend_lut[_mode] == NULL) init_blend(_mode);
+  const uint8_t * lut = blend_lut[_mode];
+#else
+  const uint8_t * lut = NULL;
+#endif
+
+  for (uint8_t row=start_row; row < end_row; row++) {
+    vga_pixel* dst = &framebuffer[((row+_y)*fb_stride)+_x+start_col];
+    vga_pixel* src = &_pixels[row * _bitmap_size_px + start_col];
+    int n = end_col-start_col;
+
+    if (_mode == BLEND_NONE) {
+      pix_copy_trans<vga_format>(dst, src, n);
+    }
+    else if (lut == NULL) {
+      // 16 bits pixels or no memory for the table
+      for (int i=0; i<n; i++) {
+        if (!vga_format::transparent(src[i])) dst[i] = blend_pixel<vga_format>(_mode, src[i], dst[i]);
+      }
+    }
+    else if (_mode == BLEND_SHADOW) {
+      for (int i=0; i<n; i++) {
+        if (!vga_format::transparent(src[i])) dst[i] = lut[dst[i]];
+      }
+    }
+    else {
+      for (int i=0; i<n; i++) {
+        vga_pixel s = src[i];
+        if (!vga_format::transparent(s)) dst[i] = lut[(s<<8)|dst[i]];
       }
     }
   }
@@ -1842,7 +3080,10 @@ void VGA_T4::set_vscroll(int layer, int colbeg, int colend, int mask)
 }
 
 /*******************************************************************
- Experimental I2S interrupt based sound driver for PCM51xx !!!
+ Experimental I2S DMA based sound driver for PCM51xx !!!
+ The DMA plays i2s_tx_buffer in a loop (ping-pong) and interrupts
+ at half and end of buffer, the half just played is then refilled
+ from the low priority software interrupt.
 *******************************************************************/
 
 FLASHMEM static void set_audioClock(int nfact, int32_t nmult, uint32_t ndiv, bool force) // sets PLL4
@@ -1867,8 +3108,6 @@ FLASHMEM static void set_audioClock(int nfact, int32_t nmult, uint32_t ndiv, boo
   CCM_ANALOG_PLL_AUDIO &= ~CCM_ANALOG_PLL_AUDIO_BYPASS;//Disable Bypass
 }
 
-#define AUDIO_SAMPLE_RATE_EXACT  11025.0 //44117.64706 //11025.0 //22050.0 //44117.64706 //31778.0
-
 FLASHMEM static void config_sai1()
 {
   CCM_CCGR5 |= CCM_CCGR5_SAI1(CCM_CCGR_ON);
@@ -1924,15 +3163,14 @@ FLASHMEM static void config_sai1()
   CORE_PIN20_CONFIG = 3;  // RX_SYNC
   CORE_PIN7_CONFIG  = 3;  // TX_DATA0
   I2S1_RCSR |= I2S_RCSR_RE | I2S_RCSR_BCE;
-  I2S1_TCSR = I2S_TCSR_TE | I2S_TCSR_BCE  | I2S_TCSR_FRDE ;//<-- not using DMA */;
+  I2S1_TCSR = I2S_TCSR_TE | I2S_TCSR_BCE  | I2S_TCSR_FRDE ; // FIFO requests serviced by DMA
 }
 
 
 
 //DMAMEM __attribute__((aligned(32))) static uint32_t i2s_tx[1024];
 
-static bool fillfirsthalf = true;
-static uint16_t cnt = 0;
+static volatile bool fillfirsthalf = true;
 static uint16_t sampleBufferSize = 0;
 
 static void (*fillsamples)(short * stream, int len) = nullptr;
@@ -1943,51 +3181,61 @@ static uint16_t * txreg = (uint16_t *)((uint32_t)&I2S1_TDR0 + 2);
 
 
 FASTRUN void VGA_T4::AUDIO_isr() {
-  
-  *txreg = i2s_tx_buffer16[cnt]; 
-  cnt = cnt + 1;
-  cnt = cnt & (sampleBufferSize*2-1);
-
-  if (cnt == 0) {
-    fillfirsthalf = false;
-    NVIC_SET_PENDING(IRQ_SOFTWARE);
-  } 
-  else if (cnt == sampleBufferSize) {
-    fillfirsthalf = true;
-    NVIC_SET_PENDING(IRQ_SOFTWARE);
+  PROFILE_START(isr_start);
+  uint32_t saddr = (uint32_t)audioDMA.TCD->SADDR;
+  audioDMA.clearInterrupt();
+  // DMA is now reading the second half: first half can be refilled
+  fillfirsthalf = (saddr >= (uint32_t)i2s_tx_buffer + sampleBufferSize*2);
+  if (audio_sync == AUDIO_SYNC_NONE) {
+    raise_software(SW_AUDIO);
   }
-/*
-  I2S1_TDR0 = i2s_tx_buffer[cnt]; 
-  cnt = cnt + 1;
-  cnt = cnt & (sampleBufferSize-1);
-  if (cnt == 0) {
-    fillfirsthalf = false;
-    NVIC_SET_PENDING(IRQ_SOFTWARE);
-  } 
-  else if (cnt == sampleBufferSize/2) {
-    fillfirsthalf = true;
-    NVIC_SET_PENDING(IRQ_SOFTWARE);
+  else {
+    // QT3_isr raises the refill at the start of the next blanking
+    audio_refill_pending = true;
   }
-*/
+  PROFILE_STOP(isr_start, PROF_AUDIO_ISR);
+  asm volatile("dsb");
 }
 
 FASTRUN void VGA_T4::SOFTWARE_isr() {
-  //Serial.println("x");
-  if (fillfirsthalf) {
-    fillsamples((short *)i2s_tx_buffer, sampleBufferSize);
-    arm_dcache_flush_delete((void*)i2s_tx_buffer, (sampleBufferSize/2)*sizeof(uint32_t));
-  }  
-  else { 
-    fillsamples((short *)&i2s_tx_buffer[sampleBufferSize/2], sampleBufferSize);
-    arm_dcache_flush_delete((void*)&i2s_tx_buffer[sampleBufferSize/2], (sampleBufferSize/2)*sizeof(uint32_t));
+  uint32_t pending = __atomic_exchange_n(&sw_pending, 0, __ATOMIC_RELAXED);
+  if ((pending & SW_AUDIO) && fillsamples != nullptr) {
+    PROFILE_START(isr_start);
+    if (fillfirsthalf) {
+      fillsamples((short *)i2s_tx_buffer, sampleBufferSize);
+      arm_dcache_flush_delete((void*)i2s_tx_buffer, (sampleBufferSize/2)*sizeof(uint32_t));
+    }  
+    else { 
+      fillsamples((short *)&i2s_tx_buffer[sampleBufferSize/2], sampleBufferSize);
+      arm_dcache_flush_delete((void*)&i2s_tx_buffer[sampleBufferSize/2], (sampleBufferSize/2)*sizeof(uint32_t));
+    }
+    PROFILE_STOP(isr_start, PROF_AUDIO_ISR);
+  }
+  if (pending & SW_STREAM) {
+    stream_service();
+  }
+  if ((pending & SW_VBLANK) && vblank_callback != NULL) {
+    vblank_callback(vblank_line);
+  }
+  for (int i=0; i<nb_line_callbacks; i++) {
+    if ((pending & (SW_LINE << i)) && line_callbacks[i].callback != NULL) {
+      line_callbacks[i].callback(line_callbacks[i].line);
+    }
   }
 }
 
 // display VGA image
-FLASHMEM void VGA_T4::begin_audio(int samplesize, void (*callback)(short * stream, int len))
+FLASHMEM void VGA_T4::begin_audio(int samplesize, void (*callback)(short * stream, int len), vga_audio_sync_t sync)
 {
+  if (sync == AUDIO_SYNC_VBLANK) {
+    // a refill can wait up to one frame: each half must outlast it
+    int frame_samples = (int)(AUDIO_SAMPLE_RATE_EXACT/frame_freq) + 1;
+    if (samplesize < 2*frame_samples) samplesize = (2*frame_samples + 15) & ~15;
+  }
+  audio_sync = sync;
+  audio_refill_pending = false;
   fillsamples = callback;
-  i2s_tx_buffer =  (uint32_t*)malloc(samplesize*sizeof(uint32_t)); //&i2s_tx[0];
+  i2s_tx_buffer =  (uint32_t*)mem_alloc(VGA_BUF_AUDIO, samplesize*sizeof(uint32_t)); //&i2s_tx[0];
 
   if (i2s_tx_buffer == NULL) {
     Serial.println("could not allocate audio samples");
@@ -1999,16 +3247,30 @@ FLASHMEM void VGA_T4::begin_audio(int samplesize, void (*callback)(short * strea
 
   sampleBufferSize = samplesize;
 
-  config_sai1();
-  attachInterruptVector(IRQ_SAI1, AUDIO_isr);
-  NVIC_ENABLE_IRQ(IRQ_SAI1);
-  NVIC_SET_PRIORITY(IRQ_QTIMER3, 0);  // 0 highest priority, 255 = lowest priority 
-  NVIC_SET_PRIORITY(IRQ_SAI1, 127);
   attachInterruptVector(IRQ_SOFTWARE, SOFTWARE_isr);
   NVIC_SET_PRIORITY(IRQ_SOFTWARE, 208);
   NVIC_ENABLE_IRQ(IRQ_SOFTWARE);
 
-  I2S1_TCSR |= 1<<8;  // start generating TX FIFO interrupts
+  // 16bits samples to the upper half of the 32bits slot, looping over the whole buffer
+  audioDMA.begin(true);
+  audioDMA.TCD->SADDR = i2s_tx_buffer16;
+  audioDMA.TCD->SOFF = 2;
+  audioDMA.TCD->ATTR = DMA_TCD_ATTR_SSIZE(1) | DMA_TCD_ATTR_DSIZE(1); // 16bits
+  audioDMA.TCD->NBYTES_MLNO = 2;
+  audioDMA.TCD->SLAST = -(samplesize*sizeof(uint32_t));
+  audioDMA.TCD->DADDR = txreg;
+  audioDMA.TCD->DOFF = 0;
+  audioDMA.TCD->CITER_ELINKNO = samplesize*2;
+  audioDMA.TCD->DLASTSGA = 0;
+  audioDMA.TCD->BITER_ELINKNO = samplesize*2;
+  audioDMA.TCD->CSR = DMA_TCD_CSR_INTHALF | DMA_TCD_CSR_INTMAJOR;
+  audioDMA.triggerAtHardwareEvent(DMAMUX_SOURCE_SAI1_TX);
+  audioDMA.attachInterrupt(AUDIO_isr);
+  NVIC_SET_PRIORITY(IRQ_QTIMER3, 0);  // 0 highest priority, 255 = lowest priority 
+  NVIC_SET_PRIORITY(IRQ_DMA_CH0 + (audioDMA.channel & 15), 127);
+  audioDMA.enable();
+
+  config_sai1();                      // TX FIFO requests now go to the DMA
 
   Serial.print("Audio sample buffer = ");
   Serial.println(samplesize);
@@ -2016,8 +3278,14 @@ FLASHMEM void VGA_T4::begin_audio(int samplesize, void (*callback)(short * strea
  
 FLASHMEM void VGA_T4::end_audio()
 {
+  audioDMA.disable();
+  audio_sync = AUDIO_SYNC_NONE;
+  audio_refill_pending = false;
+  I2S1_TCSR &= ~I2S_TCSR_TE;
+  fillsamples = nullptr;
   if (i2s_tx_buffer != NULL) {
-  	free(i2s_tx_buffer);
+  	mem_free(i2s_tx_buffer);
+  	i2s_tx_buffer = NULL;
   }
 }
 
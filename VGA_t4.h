@@ -25,21 +25,47 @@
 // Enable debug info (requires serial initialization)
 //#define DEBUG
 
+// Enable the DWT cycle profiler (see profiler.h)
+//#define VGA_PROFILE
+
+// Enable line interrupt latency/jitter statistics (see get_scanout_stats)
+//#define VGA_SCANOUT_STATS
+
+// Trace events kept in RAM (see trace.h)
+// 0 off, 1 errors, 2 info, 3 debug, 4 verbose
+#ifndef VGA_TRACE_LEVEL
+#define VGA_TRACE_LEVEL 0
+#endif
+
 // Enable 12bits mode
 // Default is 8bits RRRGGGBB (332) 
-// But 12bits GBB0RRRRGGGBB (444) feasible BUT NOT TESTED !!!!
+// 12bits is GBB0RRRRGGGBB (444), bit 9 (not wired) is the transparency flag
 //#define BITS12
+// 8bits pixels read as TIRRGGBB (transparency, intensity) instead of RRRGGGBB
+//#define TIRRGGBB
 
-
+#include "pixfmt.h"
 
 #ifdef BITS12
+typedef PixFmt444 vga_format;
 typedef uint16_t vga_pixel;
-#define VGA_RGB(r,g,b)  ( (((r>>3)&0x1f)<<11) | (((g>>2)&0x3f)<<5) | (((b>>3)&0x1f)<<0) )
+#define VGA_RGB(r,g,b)  ( (((r>>4)&0x0f)<<5) | (((g>>4)&0x07)<<2) | (((g>>7)&0x01)<<12) | ((b>>4)&0x03) | (((b>>6)&0x03)<<10) )
+typedef uint32_t vga_pixel2;     // 2 identical pixels (expand_palette2x)
+typedef uint64_t vga_pixel4;     // 4 identical pixels (expand_palette4x)
 #else
 typedef uint8_t vga_pixel;
+#ifdef TIRRGGBB
+typedef PixFmtTIRRGGBB vga_format;
+#define VGA_RGB(r,g,b)          ( (((((r)&(g)&(b))>>5)&1)<<6) | (((r>>6)&0x3)<<4) | (((g>>6)&0x3)<<2) | (((b>>6)&0x3)<<0) )
+#else
+typedef PixFmt332 vga_format;
 #define VGA_RGB(r,g,b)          ( (((r>>5)&0x07)<<5) | (((g>>5)&0x07)<<2) | (((b>>6)&0x3)<<0) )
+#endif
+typedef uint16_t vga_pixel2;
+typedef uint32_t vga_pixel4;
 #define VGA_TIRRGGBB(t,i,r,g,b) ( (t<<7) | (i<<6) | ((r<<4)&0b110000) | ((g<<2)&0b1100) | (b&0b11) )
 #endif
+#define VGA_AVG(a,b)            vga_format::avg(a,b)
 
 typedef enum vga_mode_t
 {
@@ -60,9 +86,117 @@ typedef enum vga_error_t
 	VGA_ERROR = -1
 } vga_error_t;
 
+// Memory regions a buffer can be placed in
+// OCRAM  : RAM2 (DMAMEM), where the T4 malloc heap lives (default)
+// DTCM   : RAM1 tightly coupled memory, fastest for CPU access (needs VGA_DTCM_POOL_SIZE)
+// EXTMEM : Teensy 4.1 PSRAM (falls back to OCRAM when no PSRAM is fitted)
+typedef enum vga_mem_t
+{
+  VGA_MEM_AUTO   = -1,
+  VGA_MEM_OCRAM  = 0,
+  VGA_MEM_DTCM   = 1,
+  VGA_MEM_EXTMEM = 2
+} vga_mem_t;
+
+#define VGA_MEM_REGIONS   3
+
+// Buffer kinds the memory policy applies to
+typedef enum vga_buf_t
+{
+  VGA_BUF_SCANOUT = 0,
+  VGA_BUF_BACK    = 1,
+  VGA_BUF_TILES   = 2,
+  VGA_BUF_TILEMAP = 3,
+  VGA_BUF_AUDIO   = 4
+} vga_buf_t;
+
+#define VGA_BUF_KINDS     5
+
+// Bytes reserved in DTCM for buffers placed in VGA_MEM_DTCM
+// (DTCM has no heap, so a static pool is carved at link time)
+// Set it for the whole build, e.g. -DVGA_DTCM_POOL_SIZE=32768, as the
+// library sources are compiled apart from the sketch.
+#ifndef VGA_DTCM_POOL_SIZE
+#define VGA_DTCM_POOL_SIZE 0
+#endif
+
+// Line interrupt timing, in QTIMER3 ticks (IP bus clock) after the HSYNC edge
+// hist[b] counts ISR entries with latency in [b<<SHIFT, (b+1)<<SHIFT[, last bin is open
+#define SCANOUT_HIST_BINS     32
+#define SCANOUT_HIST_SHIFT    2
+#define SCANOUT_LINES         525
+// a line is flagged late when its DMAs are re-armed after this many ticks
+#define SCANOUT_LATE_TICKS    400
+
+typedef struct {
+  uint32_t frames;
+  uint32_t lines;
+  uint16_t lat_min;       // entry latency over the last frame
+  uint16_t lat_max;
+  uint16_t jitter;        // lat_max - lat_min over the last frame
+  uint16_t jitter_max;    // worst frame jitter seen
+  uint16_t arm_max;       // latest DMA re-arm over the last frame
+  uint16_t late_lines;    // late lines in the last frame
+  uint32_t late_total;
+  uint32_t hist[SCANOUT_HIST_BINS];
+} vga_scanout_stats_t;
+
+// Asynchronous blitter on a spare eDMA channel
+// Every blit_* call returns a fence, blit_done()/blit_wait() tell when it completed.
+// The CPU must not touch the destination rows before then.
+#define VGA_BLIT_QUEUE        16
+#define VGA_BLIT_BURST        16    // max bytes per DMA minor loop, keeps scanout DMAs serviced
+typedef uint32_t vga_fence_t;
+
+// Scaler for writeLine/writeScreen (see set_scaler)
+#define VGA_SCALE_MAX         1024  // max source height
+typedef enum vga_scale_t
+{
+  SCALE_NEAREST = 0,
+  SCALE_FILTER  = 1     // 2 taps: average of both neighbours when in between
+} vga_scale_t;
+
+// Sprite blending (see blendBitmap), transparent source pixels are always skipped
+typedef enum vga_blend_t
+{
+  BLEND_NONE   = 0,     // plain transparent copy
+  BLEND_SHADOW = 1,     // darkens the destination to half
+  BLEND_ADD    = 2,     // additive glow, saturated
+  BLEND_HALF   = 3      // 50% translucency
+} vga_blend_t;
+#define VGA_BLEND_MODES       4
+
+// Line streaming (see begin_stream)
+#define VGA_STREAM_LINES      8     // DMA line buffers ahead of the beam, power of 2
+#define VGA_STREAM_QUEUE      16    // submitted lines not converted yet
+typedef enum vga_stream_fmt_t
+{
+  STREAM_INDEXED = 0,   // uint8_t indexes into the palette
+  STREAM_PIXEL   = 1,   // vga_pixel
+  STREAM_RGB565  = 2
+} vga_stream_fmt_t;
+
+// Raster callbacks (see set_vblank_callback/add_line_callback)
+// immediate: called from the line interrupt, must be very short
+// deferred : called from the low priority software interrupt
+#define VGA_LINE_CALLBACKS    4
+typedef void (*vga_raster_callback_t)(int line);
+
 #define MaxPolyPoint    100
 
 #define AUDIO_SAMPLE_BUFFER_SIZE 256
+#define AUDIO_SAMPLE_RATE_EXACT  11025.0 //44117.64706 //11025.0 //22050.0 //44117.64706 //31778.0
+
+// When the audio refill callback runs
+// NONE   : as soon as the I2S DMA has played half of the buffer
+// VBLANK : deferred to the first line of the vertical blanking, never overlaps scanout
+//          DMA as long as the callback fits in the blanking (needs begin())
+//          (buffer is enlarged so that half of it lasts a whole frame)
+typedef enum vga_audio_sync_t
+{
+  AUDIO_SYNC_NONE   = 0,
+  AUDIO_SYNC_VBLANK = 1
+} vga_audio_sync_t;
 
 // 2D point structure
 typedef struct {
@@ -175,7 +309,12 @@ public:
 
   // display VGA image
   vga_error_t begin(vga_mode_t mode);
-  void begin_audio(int samplesize, void (*callback)(short * stream, int len));
+  // scanout buffer sized for the largest of mode and pool_mode
+  vga_error_t begin(vga_mode_t mode, vga_mode_t pool_mode);
+  // runtime switch, within the buffer allocated by begin()
+  vga_error_t setMode(vga_mode_t mode);
+  static uint32_t get_mode_buffer_size(vga_mode_t mode);
+  void begin_audio(int samplesize, void (*callback)(short * stream, int len), vga_audio_sync_t sync = AUDIO_SYNC_NONE);
   void end();
   void end_audio();
   void debug();
@@ -184,7 +323,39 @@ public:
   // retrieve real size of the frame buffer
   void get_frame_buffer_size(int *width, int *height);
 
-  // wait next Vsync
+  // memory placement (set policy before begin()/constructing tiles)
+  static void set_memory_policy(vga_buf_t kind, vga_mem_t where);
+  static vga_mem_t get_memory_policy(vga_buf_t kind);
+  static void * mem_alloc(vga_buf_t kind, size_t size, vga_mem_t where = VGA_MEM_AUTO);
+  static void mem_free(void * p);
+  static uint32_t get_memory_usage(vga_mem_t where);
+  static void print_memory_layout();
+  vga_pixel * alloc_back_buffer();
+
+  // line interrupt timing (needs VGA_SCANOUT_STATS, zeroes otherwise)
+  static void get_scanout_stats(vga_scanout_stats_t * stats);
+  static void reset_scanout_stats();
+  static bool is_line_late(int line);   // DMA re-armed late in the last frame
+  static void set_late_threshold(uint16_t ticks);
+  static void print_scanout_stats();
+
+  // raster callbacks, vblank fires on the first line after the visible area
+  static void set_vblank_callback(vga_raster_callback_t callback, bool deferred = true);
+  static int add_line_callback(int line, vga_raster_callback_t callback, bool deferred = true);
+  static void remove_line_callback(int id);
+  static uint32_t get_frame_count();
+  // framebuffer row being scanned, <0 or >= height in the blanking
+  static int get_beam_row();
+
+  // asynchronous DMA fills and copies to the framebuffer (src_stride in pixels)
+  vga_fence_t blit_fill(int x, int y, int w, int h, vga_pixel color);
+  vga_fence_t blit_copy(const vga_pixel * src, int src_stride, int x, int y, int w, int h);
+  vga_fence_t blit_clear(vga_pixel color);
+  vga_fence_t blit_buffer(const vga_pixel * back);   // fb_width x fb_height back buffer to screen
+  static bool blit_done(vga_fence_t fence);
+  static void blit_wait(vga_fence_t fence);
+
+  // wait next Vsync / line, sleeping (WFI) until the line interrupt flags it
   void waitSync();
   void waitLine(int line);
 
@@ -200,13 +371,39 @@ public:
   void drawText(int16_t x, int16_t y, const char * text, vga_pixel fgcolor, vga_pixel bgcolor, bool doublesize);
   void drawSprite(int16_t x, int16_t y, const int16_t *bitmap);
   void drawSprite(int16_t x, int16_t y, const int16_t *bitmap, uint16_t croparx, uint16_t cropary, uint16_t croparw, uint16_t croparh);
+  // stretch writeLine/writeScreen calls of this source size to the whole screen
+  // through precomputed tables, 0,0 restores the default centering/halving
+  void set_scaler(int src_width, int src_height, vga_scale_t filter = SCALE_NEAREST);
   void writeScreen(const vga_pixel *pcolors);  
   void writeLine(int width, int height, int y, vga_pixel *buf);
   void writeLine(int width, int height, int stride, uint8_t *buffer, vga_pixel *palette);
-  void writeLine16(int width, int height, int y, uint16_t *buf);  
+  // RGB565 / RGB888 (R,G,B bytes) lines, optional 4x4 ordered dither (see convert.h)
+  void writeLine16(int width, int height, int y, uint16_t *buf, bool dither=false);  
+  void writeLine24(int width, int height, int y, uint8_t *buf, bool dither=false);  
   void writeScreen(int width, int height, int stride, uint8_t *buffer, vga_pixel *palette);
+  // beam raced line streaming: lines pushed in raster order are converted and scaled
+  // to the screen size into DMA line buffers just before the beam reaches them,
+  // no framebuffer copy. A pushed line must stay valid until stream_pending() drops
+  // below its position. setMode() ends streaming.
+  vga_error_t begin_stream(int src_width, int src_height, vga_stream_fmt_t format, const vga_pixel *palette = NULL, vga_scale_t filter = SCALE_NEAREST);
+  void end_stream();
+  bool stream_line(int y, const void *line);   // false if the queue is full
+  static int stream_pending();
+  // late: lines dropped as the beam had passed, missing: screen rows shown from the framebuffer
+  static void get_stream_stats(uint32_t *late, uint32_t *missing);
+  // palettes of 2 or 4 identical pixels per entry: writeLine then stores one
+  // halfword/word per source pixel when width*2 or width*4 is the screen width
+  static void expand_palette2x(const vga_pixel *palette, vga_pixel2 *palette2x, int count = 256);
+  static void expand_palette4x(const vga_pixel *palette, vga_pixel4 *palette4x, int count = 256);
+  void writeLine(int width, int height, int y, uint8_t *buf, const vga_pixel2 *palette2x);
+  void writeLine(int width, int height, int y, uint8_t *buf, const vga_pixel4 *palette4x);
   void copyLine(int width, int height, int ysrc, int ydst);
-  void drawBitmap(vga_pixel* _pixels, uint8_t _bitmap_size_px, int16_t _x, int16_t _y, uint16_t crop_top, uint16_t crop_bottom, uint16_t crop_left, uint16_t crop_right, bool _log, bool _render, bool _trans);
+  void drawBitmap(vga_pixel* _pixels, uint8_t _bitmap_size_px, int16_t _x, int16_t _y, uint16_t crop_top, uint16_t crop_bottom, uint16_t crop_left, uint16_t crop_right, bool _render, bool _trans);
+  // blended bitmap: one lookup table read per pixel with 8 bits pixels (tables built
+  // on first use, 256 bytes for shadow, 64KB for add and half under the VGA_BUF_TILES
+  // memory policy), computed per pixel with BITS12
+  void blendBitmap(vga_pixel* _pixels, uint8_t _bitmap_size_px, int16_t _x, int16_t _y, uint16_t crop_top, uint16_t crop_bottom, uint16_t crop_left, uint16_t crop_right, vga_blend_t _mode);
+  static vga_error_t init_blend(vga_blend_t mode);
 
   // ************************************** GFX API extension from darthvader ******************************************************
   void drawline(int16_t x1, int16_t y1, int16_t x2, int16_t y2, vga_pixel color);
@@ -274,6 +471,12 @@ private:
   static uint8_t _vsync_pin;
   static DMAChannel flexio1DMA;
   static DMAChannel flexio2DMA; 
+  static DMAChannel audioDMA;
+  static DMAChannel blitDMA;
+  static void blit_start();
+  static void BLIT_isr(void);
+  vga_fence_t blit_submit(const uint8_t * src, uint32_t src_stride, uint8_t * dst, uint32_t row_bytes, uint16_t rows, vga_pixel color);
+  static void config_scanout(uint32_t flexio_clock_div);
   static void QT3_isr(void);
   static void AUDIO_isr(void);  
   static void SOFTWARE_isr(void);  
@@ -1,55 +1,511 @@
 #include "VGA_t4.h"
 #include "bigmap.h"
+#include "profiler.h"
+#include "trace.h"
 #include "Arduino.h"
 #include <vector>
 #include <string>
 
-Tilelist::Tilelist(uint16_t _tile_size_px, uint16_t _max_tiles) {
+Tilelist::Tilelist(uint16_t _tile_size_px, uint16_t _max_tiles, vga_mem_t _mem) {
   tile_size_px    = _tile_size_px;
   max_tiles       = _max_tiles;
-  pixels          = (vga_pixel*) calloc(tile_size_px * tile_size_px * max_tiles, sizeof(vga_pixel));
+  pixels          = (vga_pixel*) VGA_T4::mem_alloc(VGA_BUF_TILES, tile_size_px * tile_size_px * max_tiles * sizeof(vga_pixel), _mem);
+  if (pixels != NULL) memset((void*)pixels, 0, tile_size_px * tile_size_px * max_tiles * sizeof(vga_pixel));
   num_tiles       = 0;
   tile_size_bytes = tile_size_px * tile_size_px * sizeof(vga_pixel);
+  sheet           = NULL;
+  rle             = NULL;
+  init_opaque();
+  remap           = NULL;
+  anims           = new std::vector<TileAnim>();
+  init_cache(0, _mem);
 }
 
+// Tiles stay in flash and are read in place: no RAM and no copy at startup.
+// Declare the sheet PROGMEM (num_tiles consecutive tiles of tile_size_px^2 pixels)
+// else the T4 startup code copies it to RAM1 anyway.
+// With _cache_slots > 0 the most recently used tiles are kept in RAM.
+Tilelist::Tilelist(uint16_t _tile_size_px, const vga_pixel* _sheet, uint16_t _num_tiles, uint16_t _cache_slots, vga_mem_t _mem) {
+  tile_size_px    = _tile_size_px;
+  max_tiles       = _num_tiles;
+  num_tiles       = _num_tiles;
+  tile_size_bytes = tile_size_px * tile_size_px * sizeof(vga_pixel);
+  pixels          = NULL;
+  sheet           = _sheet;
+  rle             = NULL;
+  init_opaque();
+  remap           = NULL;
+  anims           = new std::vector<TileAnim>();
+  for (uint16_t i=0; i<num_tiles; i++) {
+    set_opaque(i, scan_opaque(&sheet[(uint32_t)i * tile_size_px * tile_size_px], tile_size_px * tile_size_px));
+  }
+  init_cache(_cache_slots, _mem);
+}
+
+// Compressed tiles are decoded on demand into the LRU cache, so at least
+// one slot is needed and the RAM used stays bounded to _cache_slots tiles.
+Tilelist::Tilelist(const TileSheetRLE* _rle, uint16_t _cache_slots, vga_mem_t _mem) {
+  tile_size_px    = _rle->tile_size_px;
+  max_tiles       = _rle->num_tiles;
+  num_tiles       = _rle->num_tiles;
+  tile_size_bytes = tile_size_px * tile_size_px * sizeof(vga_pixel);
+  pixels          = NULL;
+  sheet           = NULL;
+  rle             = _rle;
+  init_opaque();
+  remap           = NULL;
+  anims           = new std::vector<TileAnim>();
+  for (uint16_t i=0; i<num_tiles; i++) {
+    set_opaque(i, rle_opaque(&rle->data[rle->offsets[i]], tile_size_px * tile_size_px));
+  }
+  init_cache(_cache_slots > 0 ? _cache_slots : 1, _mem);
+}
+
+void Tilelist::init_opaque() {
+  uint16_t words = (max_tiles + 31) / 32;
+  opaque = (uint32_t*) malloc(words * sizeof(uint32_t));
+  if (opaque == NULL) {
+    Serial.println("could not allocate tile flags");
+    return;
+  }
+  memset((void*)opaque, 0, words * sizeof(uint32_t));
+}
+
+void Tilelist::set_opaque(uint16_t _index, bool _opaque) {
+  if ( (opaque == NULL) || (_index >= max_tiles) ) return;
+  if (_opaque) opaque[_index >> 5] |=  (1u << (_index & 31));
+  else         opaque[_index >> 5] &= ~(1u << (_index & 31));
+}
+
+// without flags every tile is assumed to have transparent pixels
+bool Tilelist::is_opaque(uint16_t _index) {
+  if ( (opaque == NULL) || (_index >= max_tiles) ) return false;
+  return (opaque[_index >> 5] >> (_index & 31)) & 1;
+}
+
+void Tilelist::animate_tile(uint16_t _index, uint16_t _first_frame, uint8_t _num_frames, uint8_t _frame_ticks) {
+  TileAnim anim = { _index, _first_frame, NULL, NULL, _num_frames, _frame_ticks, 0, 0 };
+  start_animation(anim);
+}
+
+// _frames and _durations are used in place and must outlive the animation
+void Tilelist::animate_tile(uint16_t _index, const uint16_t* _frames, const uint8_t* _durations, uint8_t _num_frames) {
+  TileAnim anim = { _index, 0, _frames, _durations, _num_frames, 1, 0, 0 };
+  start_animation(anim);
+}
+
+void Tilelist::start_animation(TileAnim& _anim) {
+  if ( (_anim.index >= max_tiles) || (_anim.num_frames == 0) ) return;
+  if (remap == NULL) {
+    remap = (uint16_t*) malloc(max_tiles * sizeof(uint16_t));
+    if (remap == NULL) {
+      Serial.println("could not allocate tile remap");
+      return;
+    }
+    for (uint16_t i=0; i<max_tiles; i++) remap[i] = i;
+  }
+  stop_animation(_anim.index);
+  if (_anim.frame_ticks == 0) _anim.frame_ticks = 1;
+  _anim.ticks = (_anim.durations != NULL) ? _anim.durations[0] : _anim.frame_ticks;
+  if (_anim.ticks == 0) _anim.ticks = 1;
+  remap[_anim.index] = (_anim.frames != NULL) ? _anim.frames[0] : _anim.first_frame;
+  anims->push_back(_anim);
+}
+
+void Tilelist::stop_animation(uint16_t _index) {
+  for (size_t i=0; i<anims->size(); i++) {
+    if ((*anims)[i].index == _index) {
+      anims->erase(anims->begin() + i);
+      break;
+    }
+  }
+  if ( (remap != NULL) && (_index < max_tiles) ) remap[_index] = _index;
+}
+
+void Tilelist::advance_animations() {
+  for (TileAnim& anim : *anims) {
+    if (--anim.ticks > 0) continue;
+    if (++anim.frame >= anim.num_frames) anim.frame = 0;
+    if (anim.frames != NULL) {
+      remap[anim.index] = anim.frames[anim.frame];
+      anim.ticks = (anim.durations != NULL) ? anim.durations[anim.frame] : anim.frame_ticks;
+    }
+    else {
+      remap[anim.index] = anim.first_frame + anim.frame;
+      anim.ticks = anim.frame_ticks;
+    }
+    if (anim.ticks == 0) anim.ticks = 1;
+  }
+}
+
+bool Tilelist::scan_opaque(const vga_pixel* _pixels, uint16_t _num_pixels) {
+  for (uint16_t i=0; i<_num_pixels; i++) {
+    if (vga_format::transparent(_pixels[i])) return false;
+  }
+  return true;
+}
+
+// same on the compressed stream: every literal and run pixel is checked once
+bool Tilelist::rle_opaque(const vga_pixel* _src, uint16_t _num_pixels) {
+  uint16_t done = 0;
+  while (done < _num_pixels) {
+    uint8_t c = *_src++;
+    if (c & 0x80) {
+      if (vga_format::transparent(*_src++)) return false;
+      done += (c & 0x7f) + 2;
+    }
+    else {
+      if (!scan_opaque(_src, c + 1)) return false;
+      _src += c + 1;
+      done += c + 1;
+    }
+  }
+  return true;
+}
+
+void Tilelist::init_cache(uint16_t _slots, vga_mem_t _mem) {
+  cache_slots  = 0;
+  cache_pixels = NULL;
+  cache_tile   = NULL;
+  cache_slot   = NULL;
+  cache_stamp  = NULL;
+  cache_clock  = 0;
+  cache_hits   = 0;
+  cache_misses = 0;
+  if (_slots == 0) return;
+
+  // the bookkeeping arrays share one block placed like the tiles:
+  // stamps first (word aligned), then the slot and tile halfwords
+  cache_pixels = (vga_pixel*) VGA_T4::mem_alloc(VGA_BUF_TILES, (uint32_t)_slots * tile_size_bytes, _mem);
+  cache_stamp  = (uint32_t*) VGA_T4::mem_alloc(VGA_BUF_TILES, _slots * (sizeof(uint32_t) + sizeof(uint16_t)) + max_tiles * sizeof(uint16_t), _mem);
+  if ( (cache_pixels == NULL) || (cache_stamp == NULL) ) {
+    Serial.println("could not allocate tile cache");
+    VGA_T4::mem_free(cache_pixels);
+    VGA_T4::mem_free(cache_stamp);
+    cache_pixels = NULL;
+    cache_stamp  = NULL;
+    return;
+  }
+  cache_tile   = (uint16_t*) &cache_stamp[_slots];
+  cache_slot   = &cache_tile[_slots];
+  for (uint16_t i=0; i<_slots; i++) {
+    cache_tile[i]  = TILE_NOT_CACHED;
+    cache_stamp[i] = 0;
+  }
+  for (uint16_t i=0; i<max_tiles; i++) {
+    cache_slot[i] = TILE_NOT_CACHED;
+  }
+  cache_slots = _slots;
+}
+
+uint16_t Tilelist::cache_victim() {
+  uint16_t victim = 0;
+  for (uint16_t i=1; i<cache_slots; i++) {
+    if (cache_stamp[i] < cache_stamp[victim]) victim = i;
+  }
+  return victim;
+}
+
+vga_pixel* Tilelist::get_cached_tile(uint16_t _index) {
+  uint16_t slot = cache_slot[_index];
+  if (slot == TILE_NOT_CACHED) {
+    cache_misses++;
+    slot = cache_victim();
+    if (cache_tile[slot] != TILE_NOT_CACHED) {
+      cache_slot[cache_tile[slot]] = TILE_NOT_CACHED;
+    }
+    vga_pixel* dst = &cache_pixels[(uint32_t)slot * tile_size_px * tile_size_px];
+    if (rle != NULL) {
+      rle_decode(&rle->data[rle->offsets[_index]], dst, tile_size_px * tile_size_px);
+    }
+    else {
+      memcpy((void*) dst, (const void*) &sheet[(uint32_t)_index * tile_size_px * tile_size_px], tile_size_bytes);
+    }
+    cache_tile[slot]   = _index;
+    cache_slot[_index] = slot;
+  }
+  else {
+    cache_hits++;
+  }
+  cache_stamp[slot] = ++cache_clock;
+  return &cache_pixels[(uint32_t)slot * tile_size_px * tile_size_px];
+}
+
+uint16_t Tilelist::rle_encode(const vga_pixel* _src, uint16_t _num_pixels, vga_pixel* _dst) {
+  uint16_t i = 0;
+  uint16_t len = 0;
+  while (i < _num_pixels) {
+    uint16_t run = 1;
+    while ( (i+run < _num_pixels) && (run < 129) && (_src[i+run] == _src[i]) ) run++;
+    if (run >= 2) {
+      _dst[len++] = 0x80 | (run-2);
+      _dst[len++] = _src[i];
+      i += run;
+    }
+    else {
+      uint16_t start = i;
+      uint16_t n = 0;
+      while ( (i < _num_pixels) && (n < 128) ) {
+        if ( (i+1 < _num_pixels) && (_src[i+1] == _src[i]) ) break;
+        i++;
+        n++;
+      }
+      _dst[len++] = n-1;
+      memcpy((void*) &_dst[len], (const void*) &_src[start], n*sizeof(vga_pixel));
+      len += n;
+    }
+  }
+  return len;
+}
+
+void Tilelist::rle_decode(const vga_pixel* _src, vga_pixel* _dst, uint16_t _num_pixels) {
+  vga_pixel* end = _dst + _num_pixels;
+  while (_dst < end) {
+    uint8_t c = *_src++;
+    if (c & 0x80) {
+      uint8_t n = (c & 0x7f) + 2;
+      vga_pixel val = *_src++;
+      while (n--) *_dst++ = val;
+    }
+    else {
+      uint8_t n = c + 1;
+      memcpy((void*) _dst, (const void*) _src, n*sizeof(vga_pixel));
+      _dst += n;
+      _src += n;
+    }
+  }
+}
+
+// tiles are indexed in pixels, tile_size_bytes is only the copy size
 void Tilelist::add_tile(vga_pixel* _pixels) {
-  uint16_t base_offset = num_tiles++ * tile_size_bytes;
-  Serial.print("copying ");
-  Serial.print(tile_size_bytes);
-  Serial.println(" bytes");
+  if ( (pixels == NULL) || (num_tiles >= max_tiles) ) return;
+  TRACE_DEBUG(TRACE_TILE_ADD, num_tiles);
+  uint32_t base_offset = (uint32_t)num_tiles++ * tile_size_px * tile_size_px;
   memcpy((void*) &pixels[base_offset], (void*) _pixels, tile_size_bytes);
+  set_opaque(num_tiles-1, scan_opaque(&pixels[base_offset], tile_size_px * tile_size_px));
 }
 
-void Tilelist::add_tile_with_color(uint8_t _color, bool dotted){
-  uint16_t offset = num_tiles++ * tile_size_bytes;
-  memset( (void*) &pixels[offset], _color, tile_size_bytes);
+void Tilelist::add_tile_with_color(vga_pixel _color, bool dotted){
+  if ( (pixels == NULL) || (num_tiles >= max_tiles) ) return;
+  uint32_t offset = (uint32_t)num_tiles++ * tile_size_px * tile_size_px;
+  for (uint16_t i=0; i<tile_size_px * tile_size_px; i++) pixels[offset+i] = _color;
   if (dotted) {
-    uint8_t random_color = random(0,127);
+    vga_pixel random_color = random(0,127);
     pixels[offset+27] =random_color;
     pixels[offset+28] =random_color;
     pixels[offset+35] =random_color;
     pixels[offset+36] =random_color;
   }
+  set_opaque(num_tiles-1, scan_opaque(&pixels[offset], tile_size_px * tile_size_px));
 }
 
 vga_pixel* Tilelist::get_tile(uint16_t _index) {
-  return &pixels[_index * tile_size_bytes];
+  // out of range tile id in a map or sprite: callers skip the tile
+  if (_index >= max_tiles) return NULL;
+  if (pixels != NULL) {
+    return &pixels[(uint32_t)_index * tile_size_px * tile_size_px];
+  }
+  if (cache_slots > 0) {
+    return get_cached_tile(_index);
+  }
+  if (sheet != NULL) {
+    return (vga_pixel*) &sheet[(uint32_t)_index * tile_size_px * tile_size_px];
+  }
+  // no storage (allocation failed): callers skip the tile
+  return NULL;
 }
 
-Tilemap::Tilemap(uint16_t _num_cols, uint16_t _num_rows){
+Tilemap::Tilemap(uint16_t _num_cols, uint16_t _num_rows, vga_mem_t _mem){
   num_rows = _num_rows;
   num_cols = _num_cols;
-  tiles    = (uint16_t*) calloc(num_rows * num_cols, sizeof(uint16_t));
+  tiles    = (uint16_t*) VGA_T4::mem_alloc(VGA_BUF_TILEMAP, (uint32_t)num_rows * num_cols * sizeof(uint16_t), _mem);
+  if (tiles != NULL) memset((void*)tiles, 0, (uint32_t)num_rows * num_cols * sizeof(uint16_t));
+  chunk_size  = 0;
+  max_chunks  = 0;
+  chunk_cells = NULL;
+  chunk_key   = NULL;
+  chunk_stamp = NULL;
+  chunk_dirty = NULL;
+  reader      = NULL;
+  writer      = NULL;
+  io_ctx      = NULL;
+  chunk_errors = 0;
+  chunk_overruns = 0;
+}
+
+Tilemap::Tilemap(uint16_t _num_cols, uint16_t _num_rows, uint8_t _chunk_size, uint8_t _max_chunks,
+                 tilemap_io_t _reader, tilemap_io_t _writer, void* _ctx, vga_mem_t _mem) {
+  num_rows    = _num_rows;
+  num_cols    = _num_cols;
+  tiles       = NULL;
+  chunk_size  = _chunk_size;
+  max_chunks  = _max_chunks;
+  chunk_clock = 0;
+  last_chunk  = 0;
+  chunk_loads = 0;
+  reader      = _reader;
+  writer      = _writer;
+  io_ctx      = _ctx;
+  chunk_errors = 0;
+  chunk_overruns = 0;
+  chunk_cells = NULL;
+  chunk_key   = NULL;
+  chunk_stamp = NULL;
+  chunk_dirty = NULL;
+  if ( (reader == NULL) || (chunk_size == 0) || (max_chunks == 0) ) {
+    Serial.println("invalid tilemap chunk parameters");
+    max_chunks = 0;
+    return;
+  }
+  // the bookkeeping arrays follow the cells in the same block:
+  // keys and stamps (cells end word aligned), then the dirty flags
+  uint32_t cells_size = ((uint32_t)max_chunks * chunk_size * chunk_size * sizeof(uint16_t) + 3) & ~3;
+  chunk_cells = (uint16_t*) VGA_T4::mem_alloc(VGA_BUF_TILEMAP, cells_size + max_chunks * (2*sizeof(uint32_t) + sizeof(uint8_t)), _mem);
+  if (chunk_cells == NULL) {
+    Serial.println("could not allocate tilemap chunks");
+    max_chunks = 0;
+    return;
+  }
+  chunk_key   = (uint32_t*) ((uint8_t*)chunk_cells + cells_size);
+  chunk_stamp = &chunk_key[max_chunks];
+  chunk_dirty = (uint8_t*) &chunk_stamp[max_chunks];
+  for (uint8_t i=0; i<max_chunks; i++) {
+    chunk_key[i]   = CHUNK_NONE;
+    chunk_stamp[i] = 0;
+    chunk_dirty[i] = 0;
+  }
+}
+
+// a chunk stays dirty (and resident) until all its rows are written
+bool Tilemap::save_chunk(uint8_t _slot) {
+  if ( (writer == NULL) || (!chunk_dirty[_slot]) ) return true;
+  uint16_t  cx    = chunk_key[_slot] & 0xffff;
+  uint16_t  cy    = chunk_key[_slot] >> 16;
+  uint16_t* cells = &chunk_cells[(uint32_t)_slot * chunk_size * chunk_size];
+  uint32_t  col   = (uint32_t)cx * chunk_size;
+  uint16_t  count = (col + chunk_size > num_cols) ? num_cols - col : chunk_size;
+  for (uint8_t y=0; y<chunk_size; y++) {
+    uint32_t row = (uint32_t)cy * chunk_size + y;
+    if (row >= num_rows) break;
+    if (!writer(io_ctx, row * num_cols + col, &cells[y * chunk_size], count)) {
+      chunk_errors++;
+      return false;
+    }
+  }
+  chunk_dirty[_slot] = 0;
+  return true;
+}
+
+// returns CHUNK_SLOT_NONE when the victim could not be saved or the read failed
+uint8_t Tilemap::load_chunk(uint16_t _chunk_col, uint16_t _chunk_row) {
+  uint8_t slot = 0;
+  for (uint8_t i=1; i<max_chunks; i++) {
+    if (chunk_stamp[i] < chunk_stamp[slot]) slot = i;
+  }
+  if ( (chunk_key[slot] != CHUNK_NONE) && !save_chunk(slot) ) return CHUNK_SLOT_NONE;
+
+  uint16_t* cells = &chunk_cells[(uint32_t)slot * chunk_size * chunk_size];
+  uint32_t  col   = (uint32_t)_chunk_col * chunk_size;
+  uint16_t  count = (col + chunk_size > num_cols) ? num_cols - col : chunk_size;
+  chunk_key[slot]   = CHUNK_NONE;
+  chunk_dirty[slot] = 0;
+  memset((void*)cells, 0, chunk_size * chunk_size * sizeof(uint16_t));
+  for (uint8_t y=0; y<chunk_size; y++) {
+    uint32_t row = (uint32_t)_chunk_row * chunk_size + y;
+    if (row >= num_rows) break;
+    if (!reader(io_ctx, row * num_cols + col, &cells[y * chunk_size], count)) {
+      chunk_errors++;
+      return CHUNK_SLOT_NONE;
+    }
+  }
+  chunk_key[slot]   = ((uint32_t)_chunk_row << 16) | _chunk_col;
+  chunk_loads++;
+  return slot;
+}
+
+uint16_t* Tilemap::get_chunk(uint16_t _chunk_col, uint16_t _chunk_row) {
+  uint32_t key = ((uint32_t)_chunk_row << 16) | _chunk_col;
+  if (chunk_key[last_chunk] != key) {
+    uint8_t slot;
+    for (slot=0; slot<max_chunks; slot++) {
+      if (chunk_key[slot] == key) break;
+    }
+    if (slot == max_chunks) slot = load_chunk(_chunk_col, _chunk_row);
+    if (slot == CHUNK_SLOT_NONE) return NULL;
+    last_chunk = slot;
+    chunk_stamp[slot] = ++chunk_clock;
+  }
+  return &chunk_cells[(uint32_t)last_chunk * chunk_size * chunk_size];
+}
+
+void Tilemap::page_in(uint16_t _col1, uint16_t _row1, uint16_t _col2, uint16_t _row2, int8_t _dir_x, int8_t _dir_y) {
+  if ( (tiles != NULL) || (max_chunks == 0) ) return;
+  int32_t cx1 = _col1 / chunk_size;
+  int32_t cy1 = _row1 / chunk_size;
+  int32_t cx2 = _col2 / chunk_size;
+  int32_t cy2 = _row2 / chunk_size;
+  int32_t last_cx = (num_cols - 1) / chunk_size;
+  int32_t last_cy = (num_rows - 1) / chunk_size;
+  if (cx2 > last_cx) cx2 = last_cx;
+  if (cy2 > last_cy) cy2 = last_cy;
+  // the visible chunks would evict each other within the frame
+  if ((cx2-cx1+1) * (cy2-cy1+1) > max_chunks) {
+    chunk_overruns++;
+    TRACE_ERROR(TRACE_CHUNK_OVERRUN, (cx2-cx1+1) * (cy2-cy1+1), max_chunks);
+    return;
+  }
+  // prefetch column then row, each only if it still fits
+  int32_t px1 = cx1, px2 = cx2;
+  if ( (_dir_x > 0) && (cx2 < last_cx) ) px2++;
+  if ( (_dir_x < 0) && (cx1 > 0) ) px1--;
+  if ((px2-px1+1) * (cy2-cy1+1) <= max_chunks) {
+    cx1 = px1;
+    cx2 = px2;
+  }
+  int32_t py1 = cy1, py2 = cy2;
+  if ( (_dir_y > 0) && (cy2 < last_cy) ) py2++;
+  if ( (_dir_y < 0) && (cy1 > 0) ) py1--;
+  if ((cx2-cx1+1) * (py2-py1+1) <= max_chunks) {
+    cy1 = py1;
+    cy2 = py2;
+  }
+  for (int32_t cy=cy1; cy<=cy2; cy++) {
+    for (int32_t cx=cx1; cx<=cx2; cx++) {
+      if (get_chunk(cx, cy) != NULL) chunk_stamp[last_chunk] = ++chunk_clock;
+    }
+  }
+}
+
+bool Tilemap::flush() {
+  bool ok = true;
+  for (uint8_t i=0; i<max_chunks; i++) {
+    if ( (chunk_key[i] != CHUNK_NONE) && !save_chunk(i) ) ok = false;
+  }
+  return ok;
 }
 
 void Tilemap::setTile(uint16_t _col, uint16_t _row, uint16_t _index) { 
-  uint16_t offset = (_row * num_cols) + _col;
-  tiles[offset] = _index;
+  if (tiles != NULL) {
+    uint32_t offset = ((uint32_t)_row * num_cols) + _col;
+    tiles[offset] = _index;
+    return;
+  }
+  if ( (_col >= num_cols) || (_row >= num_rows) || (max_chunks == 0) ) return;
+  uint16_t* cells = get_chunk(_col / chunk_size, _row / chunk_size);
+  if (cells == NULL) return;
+  cells[(_row % chunk_size) * chunk_size + (_col % chunk_size)] = _index;
+  chunk_dirty[last_chunk] = 1;
 }
 
 uint16_t Tilemap::get_tile_index(uint16_t _col, uint16_t _row) { 
-  uint16_t offset = (_row * num_cols) + _col;
-  return tiles[offset];
+  if (tiles != NULL) {
+    uint32_t offset = ((uint32_t)_row * num_cols) + _col;
+    return tiles[offset];
+  }
+  if ( (_col >= num_cols) || (_row >= num_rows) || (max_chunks == 0) ) return 0;
+  uint16_t* cells = get_chunk(_col / chunk_size, _row / chunk_size);
+  if (cells == NULL) return 0;
+  return cells[(_row % chunk_size) * chunk_size + (_col % chunk_size)];
 }
 
 Viewport::Viewport(Tilemap* _tilemap, uint16_t _inner_x_offset_px, uint16_t _inner_y_offset_px, uint16_t _x_px, uint16_t _y_px, uint16_t _w_px, uint16_t _h_px) { 
@@ -60,13 +516,64 @@ Viewport::Viewport(Tilemap* _tilemap, uint16_t _inner_x_offset_px, uint16_t _inn
   y_px = _y_px;
   w_px = _w_px;
   h_px = _h_px;
+  dir_x = 0;
+  dir_y = 0;
+  affine_line = NULL;
+  clear_affine();
+  transparent  = false;
+  hidden       = NULL;
+  hidden_cells = 0;
+  hidden_valid = false;
 }
 
 void Viewport::set_inner_offset_px(uint16_t _x, uint16_t _y) {
+  dir_x = (_x > inner_x_offset_px) ? 1 : (_x < inner_x_offset_px) ? -1 : 0;
+  dir_y = (_y > inner_y_offset_px) ? 1 : (_y < inner_y_offset_px) ? -1 : 0;
   inner_x_offset_px = _x;
   inner_y_offset_px = _y;
 }
 
+void Viewport::set_affine(int32_t _a, int32_t _b, int32_t _c, int32_t _d, int32_t _x0, int32_t _y0, bool _wrap) {
+  affine_m[0] = _a;
+  affine_m[1] = _b;
+  affine_m[2] = _c;
+  affine_m[3] = _d;
+  affine_m[4] = _x0;
+  affine_m[5] = _y0;
+  affine_wrap = _wrap;
+  affine      = true;
+}
+
+// 16.16 origin computed in 64 bits, saturated to the matrix range
+static inline int32_t affine_origin(int32_t _center, float _offset) {
+  int64_t v = (int64_t)_center * 65536 - (int64_t)(_offset * 65536.0f);
+  if (v > 0x7fffffffLL) return 0x7fffffff;
+  if (v < -0x80000000LL) return -0x7fffffff - 1;
+  return (int32_t)v;
+}
+
+void Viewport::set_rotozoom(float _angle, float _zoom, int32_t _cx, int32_t _cy, bool _wrap) {
+  float a =  cosf(_angle) / _zoom;
+  float b =  sinf(_angle) / _zoom;
+  float c = -b;
+  float d =  a;
+  float hw = w_px * 0.5f;
+  float hh = h_px * 0.5f;
+  set_affine((int32_t)(a * 65536.0f), (int32_t)(b * 65536.0f), (int32_t)(c * 65536.0f), (int32_t)(d * 65536.0f),
+             affine_origin(_cx, a*hw + b*hh), affine_origin(_cy, c*hw + d*hh), _wrap);
+}
+
+void Viewport::clear_affine() {
+  affine      = false;
+  affine_wrap = true;
+  affine_m[0] = 0x10000;
+  affine_m[1] = 0;
+  affine_m[2] = 0;
+  affine_m[3] = 0x10000;
+  affine_m[4] = 0;
+  affine_m[5] = 0;
+}
+
 Screen::Screen() {
   vviewports    = new std::vector<Viewport*>();
 }
@@ -82,6 +589,7 @@ Sprite::Sprite(Tilelist* _tilelist, uint16_t _start_index, uint16_t _num_frames,
   x_px        = _x_px;
   y_px        = _y_px;
   frame       = 0;
+  blend       = BLEND_NONE;
 }
 
 uint16_t Sprite::current_tile_index() {
@@ -95,6 +603,14 @@ BigMapEngine::BigMapEngine(Screen* _screen, VGA_T4* _vga, Tilelist* _tilelist) {
   framecounter = 0;
   start_milli = 0;
   sprites = new std::vector<Sprite*>();
+  schedule = new std::vector<RenderWork>();
+  sched_misses = 0;
+  sched_last_misses = 0;
+  occlusion = false;
+  occluded_cells = 0;
+  coverage = NULL;
+  coverage_words = 0;
+  coverage_rows = 0;
 }
 
 void BigMapEngine::add_sprite(Sprite* _sprite) {
@@ -106,107 +622,265 @@ float BigMapEngine::get_fps() {
   return 1000 * (float)framecounter / (float) runtime;
 }
 
+#ifdef VGA_PROFILE
+static uint32_t user_start = 0;
+#endif
+
 void BigMapEngine::render_next_frame(bool _render) { 
   if (start_milli == 0) {
     start_milli = millis();
   }
+#ifdef VGA_PROFILE
+  // time since the previous frame returned belongs to the game loop
+  if (framecounter > 0) Profiler::add(PROF_USER, ARM_DWT_CYCCNT - user_start);
+  Profiler::end_frame();
+#endif
 
+  TRACE_INFO(TRACE_FRAME, framecounter);
   vga->waitLine(480+40);
+  PROFILE_START(clear_start);
   vga->clear(0x00);
+  PROFILE_STOP(clear_start, PROF_CLEAR);
+  if (occlusion) compute_occlusion();
+  uint8_t viewport_index = 0;
   for(Viewport* viewport : *(screen->vviewports)) {
+    PROFILE_START(viewport_start);
     render_viewport(viewport, _render); 
-    if (framecounter % 600 == 0) {
-      Serial.print("rendered viewport=");
-    }
+    viewport->hidden_valid = false;
+    PROFILE_STOP(viewport_start, PROF_VIEWPORT + viewport_index);
+    viewport_index++;
   } 
+  PROFILE_START(sprites_start);
   for(Sprite* sprite : *sprites) {
-    if (framecounter % 100 == 0) {
-      Serial.print("rendering sprite at ");
-      Serial.print(sprite->x_px);
-      Serial.print(",");
-      Serial.print(sprite->y_px);
-      Serial.print(" with current tile=");
-      Serial.println(sprite->current_tile_index());
-    }
-    vga->drawBitmap(
-      sprite->tilelist->get_tile(sprite->current_tile_index()),
+    render_sprite(sprite);
+  }
+  PROFILE_STOP(sprites_start, PROF_SPRITES);
+  tilelist->advance_animations();
+  framecounter++; 
+#ifdef VGA_PROFILE
+  user_start = ARM_DWT_CYCCNT;
+#endif
+}
+
+void BigMapEngine::render_sprite(Sprite* sprite, uint16_t _row1, uint16_t _row2) {
+  TRACE_DEBUG(TRACE_SPRITE, sprite->x_px, sprite->y_px, sprite->current_tile_index());
+  vga_pixel* tile = sprite->tilelist->get_tile(sprite->current_tile_index());
+  if (tile == NULL) return;
+  if (sprite->blend != BLEND_NONE) {
+    vga->blendBitmap(
+      tile,
       sprite->tilelist->tile_size_px,
       sprite->x_px,
       sprite->y_px,
-      // TODO these should be looked up and not hardcoded
-      0,
-      239,
+      _row1,
+      _row2,
       0,
       319,
-      framecounter % 100 == 0,
-      true,
-      true 
+      sprite->blend
     );
+    return;
   }
-  framecounter++; 
+  vga->drawBitmap(
+    tile,
+    sprite->tilelist->tile_size_px,
+    sprite->x_px,
+    sprite->y_px,
+    // TODO these should be looked up and not hardcoded
+    _row1,
+    _row2,
+    0,
+    319,
+    true,
+    true 
+  );
+}
+
+void BigMapEngine::schedule_work(uint16_t _row1, uint16_t _row2, void (*_callback)(void* _ctx), void* _ctx) {
+  RenderWork work = { SCHED_CALLBACK, _row1, _row2, _ctx, _callback };
+  schedule->push_back(work);
+}
+
+void BigMapEngine::schedule_viewport(Viewport* _viewport) {
+  RenderWork work = { SCHED_VIEWPORT, _viewport->y_px, (uint16_t)(_viewport->y_px + _viewport->h_px - 1), _viewport, NULL };
+  schedule->push_back(work);
+}
+
+void BigMapEngine::schedule_sprite(Sprite* _sprite) {
+  RenderWork work = { SCHED_SPRITE, _sprite->y_px, (uint16_t)(_sprite->y_px + _sprite->tilelist->tile_size_px - 1), _sprite, NULL };
+  schedule->push_back(work);
+}
+
+// rows of a work item inside the band: callbacks cannot be clipped, they
+// run once with the band holding their last row
+static bool sched_in_band(const RenderWork& _work, uint16_t _band1, uint16_t _band2, uint16_t _height) {
+  uint16_t row2 = (_work.row2 >= _height) ? _height-1 : _work.row2;
+  if (_work.kind == SCHED_CALLBACK) return (row2 >= _band1) && (row2 <= _band2);
+  return (_work.row1 <= _band2) && (row2 >= _band1);
+}
+
+uint16_t BigMapEngine::run_schedule(bool _render) {
+  int width, height;
+  vga->get_frame_buffer_size(&width, &height);
+  uint16_t misses = 0;
+  // the whole pass follows the beam of one frame, the next one when
+  // started in the bottom blanking
+  uint32_t frame;
+  int beam;
+  do {
+    frame = vga->get_frame_count();
+    beam  = vga->get_beam_row();
+  } while (frame != vga->get_frame_count());
+  if (beam >= height) frame++;
+
+  for (uint16_t band1=0; band1<height; band1+=SCHED_BAND_ROWS) {
+    uint16_t band2 = band1 + SCHED_BAND_ROWS - 1;
+    if (band2 >= height) band2 = height-1;
+    bool any = false;
+    for (RenderWork& work : *schedule) {
+      if (sched_in_band(work, band1, band2, height)) {
+        any = true;
+        break;
+      }
+    }
+    if (!any) continue;
+
+    // wait for the beam to leave the band (the bottom blanking counts as
+    // past, the top one does not), not at all once the frame is over
+    for (;;) {
+      int32_t pass = (int32_t)(vga->get_frame_count() - frame);
+      if ( (pass > 0) || ((pass == 0) && (vga->get_beam_row() > band2)) ) break;
+      asm volatile("wfi");
+    }
+    // every item of the band in one dispatch, in schedule order
+    for (RenderWork& work : *schedule) {
+      if (!sched_in_band(work, band1, band2, height)) continue;
+      switch (work.kind) {
+        case SCHED_VIEWPORT:
+          render_viewport((Viewport*)work.target, _render, band1, band2);
+          break;
+        case SCHED_SPRITE:
+          render_sprite((Sprite*)work.target, band1, band2);
+          break;
+        default:
+          work.callback(work.target);
+          break;
+      }
+    }
+    // torn if the next scan of the band has already started
+    uint32_t late = vga->get_frame_count() - frame;
+    beam = vga->get_beam_row();
+    if (late > 1 || (late == 1 && beam >= (int)band1)) {
+      misses++;
+      TRACE_ERROR(TRACE_DEADLINE_MISS, band1, band2, beam, late);
+    }
+  }
+  for (RenderWork& work : *schedule) {
+    if (work.kind == SCHED_VIEWPORT) ((Viewport*)work.target)->hidden_valid = false;
+  }
+  schedule->clear();
+  sched_last_misses = misses;
+  sched_misses += misses;
+  return misses;
+}
+
+void BigMapEngine::render_next_frame_beam(bool _render) {
+  if (start_milli == 0) {
+    start_milli = millis();
+  }
+#ifdef VGA_PROFILE
+  // same frame boundary as render_next_frame()
+  if (framecounter > 0) Profiler::add(PROF_USER, ARM_DWT_CYCCNT - user_start);
+  Profiler::end_frame();
+#endif
+  TRACE_INFO(TRACE_FRAME, framecounter);
+  if (occlusion) compute_occlusion();
+  for(Viewport* viewport : *(screen->vviewports)) {
+    schedule_viewport(viewport);
+  }
+  for(Sprite* sprite : *sprites) {
+    schedule_sprite(sprite);
+  }
+  run_schedule(_render);
+  tilelist->advance_animations();
+  framecounter++;
+#ifdef VGA_PROFILE
+  user_start = ARM_DWT_CYCCNT;
+#endif
 }
 
-void BigMapEngine::render_viewport(Viewport* viewport, bool _render) {
+// cells of the tilemap covering a viewport: one extra column and row for
+// the partially visible tiles at the offset, one more as prefetch margin
+typedef struct {
+  uint16_t col1;
+  uint16_t col2;
+  uint16_t xoff;
+  uint16_t row1;
+  uint16_t row2;
+  uint16_t voff;
+} ViewportCells;
+
+static void viewport_cells(Viewport* _viewport, uint8_t _tile_size_px, ViewportCells* _cells) {
+  _cells->col1 = _viewport->inner_x_offset_px / _tile_size_px;
+  _cells->col2 = _cells->col1 + _viewport->w_px/_tile_size_px + 2;
+  _cells->xoff = _viewport->inner_x_offset_px % _tile_size_px;
+  _cells->row1 = _viewport->inner_y_offset_px / _tile_size_px;
+  _cells->row2 = _cells->row1 + _viewport->h_px/_tile_size_px + 2;
+  _cells->voff = _viewport->inner_y_offset_px % _tile_size_px;
+}
 
-  uint16_t col1   = viewport->inner_x_offset_px / tilelist->tile_size_px;
-  uint16_t width  = viewport->w_px/tilelist->tile_size_px;
-  uint16_t col2   = col1+width+2;
-  uint16_t xoff   = viewport->inner_x_offset_px % tilelist->tile_size_px;
+void BigMapEngine::render_viewport(Viewport* viewport, bool _render, uint16_t _row1, uint16_t _row2) {
+  bool cull = viewport->hidden_valid;
+  if (viewport->affine) {
+    render_viewport_affine(viewport, _render, _row1, _row2);
+    return;
+  }
 
-  uint16_t row1   = viewport->inner_y_offset_px / tilelist->tile_size_px;
-  uint16_t height = viewport->h_px/tilelist->tile_size_px;
-  uint16_t row2   = row1+height+2; 
-  uint16_t voff   = viewport->inner_y_offset_px % tilelist->tile_size_px;
+  ViewportCells cells;
+  viewport_cells(viewport, tilelist->tile_size_px, &cells);
+  uint16_t col1   = cells.col1;
+  uint16_t col2   = cells.col2;
+  uint16_t xoff   = cells.xoff;
+  uint16_t row1   = cells.row1;
+  uint16_t row2   = cells.row2;
+  uint16_t voff   = cells.voff;
 
   uint16_t crop_top    = viewport->y_px;
   uint16_t crop_left   = viewport->x_px;
   uint16_t crop_bottom = viewport->y_px + viewport->h_px -1;
   uint16_t crop_right  = viewport->x_px + viewport->w_px -1;
+  if (crop_top < _row1) crop_top = _row1;
+  if (crop_bottom > _row2) crop_bottom = _row2;
+  if (crop_top > crop_bottom) return;
+
+  viewport->tilemap->page_in(col1, row1, col2-1, row2-1, viewport->dir_x, viewport->dir_y);
 
-  if (framecounter % 600 == 0) {
-    Serial.print(" frame=");
-    Serial.print(framecounter);
-    Serial.print(" height=");
-    Serial.print(height);
-    Serial.print(" inner_yoff=");
-    Serial.print(viewport->inner_y_offset_px);
-    Serial.print(" voff=");
-    Serial.print(voff);
-    Serial.print(" cols=");
-    Serial.print(col1);
-    Serial.print("...");
-    Serial.print(col2);
-    Serial.print(" rows=");
-    Serial.print(row1);
-    Serial.print("...");
-    Serial.println(row2);
-  }
-
-  for(uint8_t r=row1; r<row2; r++) {
+  TRACE_INFO(TRACE_VIEWPORT, framecounter, col1, col2, row1, row2);
+
+  uint32_t cell = 0;
+  for(uint16_t r=row1; r<row2; r++) {
 
     int16_t viewport_line = ((r-row1) * tilelist->tile_size_px) - voff;
     int16_t screen_line   = viewport->y_px + viewport_line;
 
-    if (framecounter % 600 == 0) {
-      Serial.print("rendering maprow=");
-      Serial.print(r);
-      Serial.print(" viewport line=");
-      Serial.print(viewport_line);
-      Serial.print(" screen line=");
-      Serial.print(screen_line);
-      Serial.print(" crop_top=");
-      Serial.print(crop_top);
-      Serial.print(" crop_bottom=");
-      Serial.println(crop_bottom);
+    // rows outside the band
+    if (screen_line > (int16_t)crop_bottom) break;
+    if (screen_line + tilelist->tile_size_px <= (int16_t)crop_top) {
+      cell += col2 - col1;
+      continue;
     }
-    for(uint8_t c=col1; c<col2; c++) {
+
+    TRACE_DEBUG(TRACE_MAP_ROW, r, viewport_line, screen_line, crop_top, crop_bottom);
+    for(uint16_t c=col1; c<col2; c++, cell++) {
+
+      if (cull && ((viewport->hidden[cell >> 5] >> (cell & 31)) & 1)) continue;
 
       int16_t viewport_col = ((c-col1) * tilelist->tile_size_px) - xoff;
       int16_t screen_col   = viewport->x_px + viewport_col;
 
-      uint8_t tile_index = viewport->tilemap->get_tile_index(c,r); 
+      vga_pixel* tile = tilelist->get_tile(tilelist->resolve(viewport->tilemap->get_tile_index(c,r)));
+      if (tile == NULL) continue;
       vga->drawBitmap(
-        tilelist->get_tile(tile_index),
+        tile,
         tilelist->tile_size_px,
         screen_col,
         screen_line,
@@ -214,11 +888,206 @@ void BigMapEngine::render_viewport(Viewport* viewport, bool _render) {
         crop_bottom,
         crop_left,
         crop_right,
-        framecounter % 600 == 0 && r == row2-1 && c == col2-1,
         _render ,
-        false
+        viewport->transparent
       );
     } 
   }
 }
 
+/*******************************************************************
+ Occlusion
+ Coverage is a 1 bit per pixel mask of the framebuffer, 32 pixels
+ per word. Testing or marking a tile costs tile_size_px rows of one
+ to a few words, far less than drawing it.
+*******************************************************************/
+// pixels _x1.._x2 of a coverage row
+static void span_set(uint32_t* _row, int _x1, int _x2) {
+  int w1 = _x1 >> 5;
+  int w2 = _x2 >> 5;
+  uint32_t m1 = 0xffffffffu << (_x1 & 31);
+  uint32_t m2 = 0xffffffffu >> (31 - (_x2 & 31));
+  if (w1 == w2) {
+    _row[w1] |= m1 & m2;
+    return;
+  }
+  _row[w1++] |= m1;
+  while (w1 < w2) _row[w1++] = 0xffffffffu;
+  _row[w2] |= m2;
+}
+
+static bool span_full(const uint32_t* _row, int _x1, int _x2) {
+  int w1 = _x1 >> 5;
+  int w2 = _x2 >> 5;
+  uint32_t m1 = 0xffffffffu << (_x1 & 31);
+  uint32_t m2 = 0xffffffffu >> (31 - (_x2 & 31));
+  if (w1 == w2) return (_row[w1] & m1 & m2) == (m1 & m2);
+  if ((_row[w1++] & m1) != m1) return false;
+  while (w1 < w2) {
+    if (_row[w1++] != 0xffffffffu) return false;
+  }
+  return (_row[w2] & m2) == m2;
+}
+
+// Front to back: each viewport is tested against what the viewports above
+// it cover, then adds its own opaque tiles. Drawing stays back to front so
+// partially covered tiles need no per pixel masking.
+void BigMapEngine::compute_occlusion() {
+  int width, height;
+  vga->get_frame_buffer_size(&width, &height);
+  uint16_t words = (width + 31) / 32;
+  if ( (coverage == NULL) || (coverage_words != words) || (coverage_rows != height) ) {
+    free(coverage);
+    coverage = (uint32_t*) malloc((uint32_t)words * height * sizeof(uint32_t));
+    if (coverage == NULL) {
+      Serial.println("could not allocate coverage");
+      occlusion = false;
+      return;
+    }
+    coverage_words = words;
+    coverage_rows  = height;
+  }
+  memset((void*)coverage, 0, (uint32_t)words * height * sizeof(uint32_t));
+  occluded_cells = 0;
+
+  uint8_t ts = tilelist->tile_size_px;
+  std::vector<Viewport*>& viewports = *(screen->vviewports);
+  for (int v=(int)viewports.size()-1; v>=0; v--) {
+    Viewport* viewport = viewports[v];
+    bool top    = (v == (int)viewports.size()-1);   // nothing above: no test
+    bool bottom = (v == 0);                         // nothing below: no mark
+    viewport->hidden_valid = false;
+
+    int x1 = viewport->x_px;
+    int y1 = viewport->y_px;
+    int x2 = viewport->x_px + viewport->w_px - 1;
+    int y2 = viewport->y_px + viewport->h_px - 1;
+    if (x2 >= width)  x2 = width-1;
+    if (y2 >= height) y2 = height-1;
+    if ( (x1 > x2) || (y1 > y2) ) continue;
+
+    if (viewport->affine) {
+      // every pixel is written, never culled as the cells are not a grid
+      if (!bottom) {
+        for (int y=y1; y<=y2; y++) span_set(&coverage[y*words], x1, x2);
+      }
+      continue;
+    }
+
+    ViewportCells cells;
+    viewport_cells(viewport, ts, &cells);
+    uint32_t num_cells = (uint32_t)(cells.col2 - cells.col1) * (cells.row2 - cells.row1);
+    if (!top && (viewport->hidden_cells < num_cells)) {
+      free(viewport->hidden);
+      viewport->hidden = (uint32_t*) malloc(((num_cells + 31) / 32) * sizeof(uint32_t));
+      viewport->hidden_cells = (viewport->hidden != NULL) ? num_cells : 0;
+    }
+    bool test = !top && (viewport->hidden != NULL);
+    if (test) memset((void*)viewport->hidden, 0, ((num_cells + 31) / 32) * sizeof(uint32_t));
+    if (viewport->transparent && !bottom) {
+      viewport->tilemap->page_in(cells.col1, cells.row1, cells.col2-1, cells.row2-1, viewport->dir_x, viewport->dir_y);
+    }
+
+    uint32_t cell = 0;
+    for (uint16_t r=cells.row1; r<cells.row2; r++) {
+      int ty1 = y1 + (r-cells.row1) * ts - cells.voff;
+      int ty2 = ty1 + ts - 1;
+      if (ty1 < y1) ty1 = y1;
+      if (ty2 > y2) ty2 = y2;
+      for (uint16_t c=cells.col1; c<cells.col2; c++, cell++) {
+        int tx1 = x1 + (c-cells.col1) * ts - cells.xoff;
+        int tx2 = tx1 + ts - 1;
+        if (tx1 < x1) tx1 = x1;
+        if (tx2 > x2) tx2 = x2;
+        if ( (tx1 > tx2) || (ty1 > ty2) ) continue;
+
+        if (test) {
+          int y = ty1;
+          while ( (y <= ty2) && span_full(&coverage[y*words], tx1, tx2) ) y++;
+          if (y > ty2) {
+            viewport->hidden[cell >> 5] |= 1u << (cell & 31);
+            occluded_cells++;
+            continue;
+          }
+        }
+        // cells of one viewport do not overlap: marking as we go is safe
+        if (bottom) continue;
+        if (viewport->transparent && !tilelist->is_opaque(tilelist->resolve(viewport->tilemap->get_tile_index(c, r)))) continue;
+        for (int y=ty1; y<=ty2; y++) span_set(&coverage[y*words], tx1, tx2);
+      }
+    }
+    viewport->hidden_valid = test;
+  }
+  TRACE_DEBUG(TRACE_OCCLUSION, framecounter, occluded_cells);
+}
+
+// map coordinate (integer map pixels) brought back into 0..size-1
+static inline int32_t affine_fold(int32_t _p, int32_t _size, bool _wrap) {
+  if (_wrap) {
+    _p %= _size;
+    return (_p < 0) ? _p + _size : _p;
+  }
+  return (_p < 0) ? 0 : _size-1;
+}
+
+// Mode 7: every viewport row walks the map along (a,c) in 16.16 fixed point,
+// the row start costs 2 multiplies, a pixel only adds and shifts. The tile
+// under the walk is looked up again only when the cell changes.
+void BigMapEngine::render_viewport_affine(Viewport* viewport, bool _render, uint16_t _row1, uint16_t _row2) {
+  Tilemap* map   = viewport->tilemap;
+  uint8_t  ts    = tilelist->tile_size_px;
+  uint8_t  shift = 0;
+  while ((1 << shift) < ts) shift++;
+  bool     pow2  = ((1 << shift) == ts);
+  int32_t  map_w = (int32_t)map->num_cols * ts;
+  int32_t  map_h = (int32_t)map->num_rows * ts;
+  int width, height;
+  vga->get_frame_buffer_size(&width, &height);
+
+  TRACE_INFO(TRACE_VIEWPORT, framecounter, 0, map->num_cols, 0, map->num_rows);
+  if (!_render) return;
+
+  uint16_t first = (_row1 > viewport->y_px) ? _row1 - viewport->y_px : 0;
+  for (uint16_t line=first; line<viewport->h_px; line++) {
+    int16_t screen_line = viewport->y_px + line;
+    if ( (screen_line >= height) || (screen_line > _row2) ) break;
+    int32_t m[6];
+    memcpy(m, viewport->affine_m, sizeof(m));
+    if (viewport->affine_line != NULL) viewport->affine_line(viewport, line, m);
+    int32_t u = m[4] + m[1] * line;
+    int32_t v = m[5] + m[3] * line;
+
+    vga_pixel* dst = vga->getLineBuffer(screen_line) + viewport->x_px;
+    int32_t    cell_col = -1;
+    int32_t    cell_row = -1;
+    vga_pixel* tile = NULL;
+    for (uint16_t x=0; x<viewport->w_px; x++) {
+      int32_t px = u >> 16;
+      int32_t py = v >> 16;
+      u += m[0];
+      v += m[2];
+      if ((uint32_t)px >= (uint32_t)map_w) px = affine_fold(px, map_w, viewport->affine_wrap);
+      if ((uint32_t)py >= (uint32_t)map_h) py = affine_fold(py, map_h, viewport->affine_wrap);
+      int32_t col, row, tx, ty;
+      if (pow2) {
+        col = px >> shift;
+        row = py >> shift;
+        tx  = px & (ts-1);
+        ty  = py & (ts-1);
+      }
+      else {
+        col = px / ts;
+        row = py / ts;
+        tx  = px - col*ts;
+        ty  = py - row*ts;
+      }
+      if ((col != cell_col) || (row != cell_row)) {
+        cell_col = col;
+        cell_row = row;
+        tile = tilelist->get_tile(tilelist->resolve(map->get_tile_index(col, row)));
+        if (tile == NULL) return;
+      }
+      *dst++ = pow2 ? tile[(ty << shift) + tx] : tile[ty*ts + tx];
+    }
+  }
+}
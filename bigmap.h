@@ -6,6 +6,34 @@
 #define MAX_TILES = 512;
 #include <string>
 
+#define TILE_NOT_CACHED 0xffff
+
+// RLE compressed tile sheet, every tile can be decoded on its own.
+// Stream of control words followed by pixels:
+// - c < 0x80 : c+1 literal pixels follow
+// - c >= 0x80: next pixel repeated (c&0x7f)+2 times
+// offsets[i] is where tile i starts in data, offsets[num_tiles] the end.
+typedef struct {
+  uint16_t         num_tiles;
+  uint8_t          tile_size_px;
+  const uint32_t*  offsets;
+  const vga_pixel* data;
+} TileSheetRLE;
+
+// Animated tile: the logical index is drawn as frames[0..num_frames-1]
+// (or first_frame, first_frame+1...), each shown durations[i] (or
+// frame_ticks) engine frames.
+typedef struct {
+  uint16_t        index;
+  uint16_t        first_frame;
+  const uint16_t* frames;
+  const uint8_t*  durations;
+  uint8_t         num_frames;
+  uint8_t         frame_ticks;
+  uint8_t         frame;
+  uint8_t         ticks;
+} TileAnim;
+
 class Tilelist{
 public:
   uint8_t tile_size_px;
@@ -14,23 +42,125 @@ public:
   uint16_t tile_size_bytes;
   vga_pixel* pixels;
 
-  Tilelist(uint16_t _tile_size_px, uint16_t maxtiles);
-  void add_tile_with_color(uint8_t _color, bool _dotted);
+  // flash resident tile sheet (PROGMEM), used in place of pixels when set
+  const vga_pixel* sheet;
+  // or compressed sheet, decoded into the cache on demand
+  const TileSheetRLE* rle;
+
+  // optional RAM cache of the most recently used sheet tiles (LRU)
+  uint16_t   cache_slots;
+  vga_pixel* cache_pixels;
+  uint16_t*  cache_tile;    // tile held by each slot
+  uint16_t*  cache_slot;    // slot holding each tile or TILE_NOT_CACHED
+  uint32_t*  cache_stamp;   // last use of each slot
+  uint32_t   cache_clock;
+  uint32_t   cache_hits;
+  uint32_t   cache_misses;
+
+  // bit per tile, set when the tile has no transparent pixel (computed at load time)
+  uint32_t*  opaque;
+
+  // logical tile index to the physical tile drawn (NULL: identity), updated
+  // by advance_animations() so a frame costs one step per animated tile
+  // whatever the number of cells using it
+  uint16_t*              remap;
+  std::vector<TileAnim>* anims;
+
+  Tilelist(uint16_t _tile_size_px, uint16_t maxtiles, vga_mem_t _mem = VGA_MEM_AUTO);
+  Tilelist(uint16_t _tile_size_px, const vga_pixel* _sheet, uint16_t _num_tiles, uint16_t _cache_slots = 0, vga_mem_t _mem = VGA_MEM_AUTO);
+  Tilelist(const TileSheetRLE* _rle, uint16_t _cache_slots, vga_mem_t _mem = VGA_MEM_AUTO);
+  void add_tile_with_color(vga_pixel _color, bool _dotted);
   void add_tile(vga_pixel*);
+  // NULL when _index is out of range or the tilelist has no storage (failed allocation)
   vga_pixel* get_tile(uint16_t _index);
+  bool is_opaque(uint16_t _index);
+
+  // tiles of the map set to _index are drawn animated, frames are physical tiles
+  void animate_tile(uint16_t _index, uint16_t _first_frame, uint8_t _num_frames, uint8_t _frame_ticks);
+  void animate_tile(uint16_t _index, const uint16_t* _frames, const uint8_t* _durations, uint8_t _num_frames);
+  void stop_animation(uint16_t _index);
+  // one engine frame (called by BigMapEngine::render_next_frame*)
+  void advance_animations();
+  inline uint16_t resolve(uint16_t _index) {
+    return ( (remap != NULL) && (_index < max_tiles) ) ? remap[_index] : _index;
+  }
+
+  // compress one tile, returns the number of vga_pixel written to _dst
+  // (_dst must hold _num_pixels + _num_pixels/128 + 1 entries)
+  static uint16_t rle_encode(const vga_pixel* _src, uint16_t _num_pixels, vga_pixel* _dst);
+  static void rle_decode(const vga_pixel* _src, vga_pixel* _dst, uint16_t _num_pixels);
+
+private:
+  void init_cache(uint16_t _slots, vga_mem_t _mem);
+  void init_opaque();
+  void start_animation(TileAnim& _anim);
+  void set_opaque(uint16_t _index, bool _opaque);
+  static bool scan_opaque(const vga_pixel* _pixels, uint16_t _num_pixels);
+  static bool rle_opaque(const vga_pixel* _src, uint16_t _num_pixels);
+  uint16_t cache_victim();
+  vga_pixel* get_cached_tile(uint16_t _index);
 };
 
+// Backing store access for chunked tilemaps: transfer _count cells starting at
+// cell _offset of the row-major map (e.g. SD: seek to _offset*2, read _count*2 bytes).
+// Returns false on error.
+typedef bool (*tilemap_io_t)(void* _ctx, uint32_t _offset, uint16_t* _cells, uint16_t _count);
+
+#define CHUNK_NONE 0xffffffff
+#define CHUNK_SLOT_NONE 0xff
+
 class Tilemap{
 public:
   uint16_t* tiles;
   uint16_t  num_rows;
   uint16_t  num_cols;
 
-  Tilemap(uint16_t _num_cols, uint16_t _num_rows);
+  // chunked mode (tiles == NULL): only max_chunks chunks of chunk_size x chunk_size
+  // cells are resident, the rest of the map lives in the backing store
+  // (reader is required, writer optional). A chunk that fails to read is not
+  // kept and is read again on next access, a dirty chunk that fails to write
+  // stays resident and dirty.
+  // A viewport of w x h pixels over tiles of t pixels needs at least
+  // (w/(t*chunk_size)+2) * (h/(t*chunk_size)+2) chunks, one more column and
+  // row for the scroll prefetch; with fewer the map is read again each frame.
+  uint8_t      chunk_size;
+  uint8_t      max_chunks;
+  uint16_t*    chunk_cells;
+  uint32_t*    chunk_key;     // (chunk row<<16)|chunk col or CHUNK_NONE
+  uint32_t*    chunk_stamp;
+  uint8_t*     chunk_dirty;
+  uint32_t     chunk_clock;
+  uint8_t      last_chunk;
+  uint32_t     chunk_loads;
+  uint32_t     chunk_errors;  // failed reads or writes, the cells read as tile 0
+  uint32_t     chunk_overruns; // page_in() rectangles larger than max_chunks
+  tilemap_io_t reader;
+  tilemap_io_t writer;
+  void*        io_ctx;
+
+  Tilemap(uint16_t _num_cols, uint16_t _num_rows, vga_mem_t _mem = VGA_MEM_AUTO);
+  Tilemap(uint16_t _num_cols, uint16_t _num_rows, uint8_t _chunk_size, uint8_t _max_chunks,
+          tilemap_io_t _reader, tilemap_io_t _writer, void* _ctx, vga_mem_t _mem = VGA_MEM_AUTO);
   void setTile(uint16_t _col, uint16_t _row, uint16_t _index);
   uint16_t get_tile_index(uint16_t _col, uint16_t _row);
+  // make the chunks covering the cell rectangle resident, plus one chunk
+  // ahead in the scroll direction when max_chunks allows it
+  void page_in(uint16_t _col1, uint16_t _row1, uint16_t _col2, uint16_t _row2, int8_t _dir_x, int8_t _dir_y);
+  // write modified chunks back (writer only), false if a write failed
+  bool flush();
+
+private:
+  uint16_t* get_chunk(uint16_t _chunk_col, uint16_t _chunk_row);
+  uint8_t load_chunk(uint16_t _chunk_col, uint16_t _chunk_row);
+  bool save_chunk(uint8_t _slot);
 };
 
+class Viewport;
+
+// Per scanline update of an affine viewport: _m holds a, b, c, d, x0, y0 of
+// the frame and may be changed for this line only (e.g. perspective floors)
+typedef void (*affine_line_t)(Viewport* _viewport, uint16_t _line, int32_t* _m);
+
 class Viewport{
 public:
   Tilemap* tilemap;
@@ -40,8 +170,31 @@ public:
   uint16_t y_px;
   uint16_t w_px; 
   uint16_t h_px;
+  int8_t   dir_x;   // last scroll direction, used for chunk prefetch
+  int8_t   dir_y;
+
+  // affine (mode 7) sampling, 16.16 fixed point: the map pixel under viewport
+  // pixel (x,y) is (x0 + a*x + b*y, y0 + c*x + d*y), stepped by (a,c) along a row
+  bool          affine;
+  bool          affine_wrap;    // wrap around the map, else clamp to the edge
+  int32_t       affine_m[6];    // a, b, c, d, x0, y0
+  affine_line_t affine_line;
+
+  // layering: a transparent viewport skips transparent tile pixels so the
+  // lower viewports show through, hidden marks its cells fully covered by
+  // higher viewports (filled by the occlusion pass, used by the next render)
+  bool      transparent;
+  uint32_t* hidden;
+  uint32_t  hidden_cells;
+  bool      hidden_valid;
+
   Viewport(Tilemap* _tilemap, uint16_t _inner_x_offset_px, uint16_t _inner_y_offset_px, uint16_t _x_px, uint16_t _y_px, uint16_t _w_px, uint16_t _h_px);
   void set_inner_offset_px(uint16_t _x, uint16_t _y);
+  void set_affine(int32_t _a, int32_t _b, int32_t _c, int32_t _d, int32_t _x0, int32_t _y0, bool _wrap = true);
+  // map pixel (_cx,_cy) at the viewport center, rotated by _angle (radians) and zoomed
+  // (16.16 matrix: map pixels are addressed up to 32767, larger centers saturate)
+  void set_rotozoom(float _angle, float _zoom, int32_t _cx, int32_t _cy, bool _wrap = true);
+  void clear_affine();
 };
 
 class Screen { 
@@ -63,10 +216,40 @@ public:
   uint16_t y_px;
   uint8_t  w_px;
   uint8_t  h_px;
+  vga_blend_t blend;    // BLEND_NONE by default
   Sprite(Tilelist* _tilelist, uint16_t _start_index, uint16_t _num_frames, uint16_t _x_px, uint16_t _y_px);
   uint16_t current_tile_index();
 };
 
+// Beam aware scheduling: a work item only touches framebuffer rows
+// row1..row2. The screen is redrawn in bands of SCHED_BAND_ROWS rows,
+// top to bottom within one frame: a band is dispatched once the beam has
+// scanned past it, so a single buffer is redrawn without tearing as long
+// as each band is done before the next scan reaches it. Viewports and
+// sprites are clipped to the band, callbacks run once with the band
+// holding their last row. In a band, items run in the order they were
+// scheduled (later items may overdraw earlier ones).
+// A deadline miss is a band that finished after the beam of a later
+// frame had already reached its first row.
+#ifndef SCHED_BAND_ROWS
+#define SCHED_BAND_ROWS 16
+#endif
+
+typedef enum sched_kind_t
+{
+  SCHED_VIEWPORT = 0,
+  SCHED_SPRITE   = 1,
+  SCHED_CALLBACK = 2
+} sched_kind_t;
+
+typedef struct {
+  uint8_t  kind;
+  uint16_t row1;
+  uint16_t row2;
+  void*    target;                    // Viewport*, Sprite* or callback context
+  void     (*callback)(void* _ctx);
+} RenderWork;
+
 class BigMapEngine {
 public:
   Screen*               screen;
@@ -81,8 +264,34 @@ public:
   void add_sprite(Sprite* _sprite);
   float get_fps();
 
+  // Occlusion for stacked viewports (later ones are on top): before drawing,
+  // the viewports are walked front to back and the cells fully covered by
+  // opaque tiles of higher viewports are marked, then skipped while drawing
+  // back to front. Opaque means any tile of a non transparent viewport, or a
+  // tile of a transparent one without transparent pixel.
+  bool     occlusion;
+  uint32_t occluded_cells;            // cells skipped in the last frame
+
+  // beam aware rendering without back buffer
+  std::vector<RenderWork>* schedule;
+  uint32_t sched_misses;              // total deadline misses
+  uint16_t sched_last_misses;         // bands missed by the last run_schedule()
+  void schedule_viewport(Viewport* _viewport);
+  void schedule_sprite(Sprite* _sprite);
+  void schedule_work(uint16_t _row1, uint16_t _row2, void (*_callback)(void* _ctx), void* _ctx);
+  uint16_t run_schedule(bool _render);
+  // all viewports then all sprites, dispatched behind the beam (no clear)
+  void render_next_frame_beam(bool _render);
+
 private:
-  void render_viewport(Viewport* viewport, bool _render);
+  // _row1.._row2: screen rows to redraw (a band of the beam scheduler)
+  void render_viewport(Viewport* viewport, bool _render, uint16_t _row1 = 0, uint16_t _row2 = 0xffff);
+  void render_viewport_affine(Viewport* viewport, bool _render, uint16_t _row1, uint16_t _row2);
+  void compute_occlusion();
+  uint32_t* coverage;                 // one bit per framebuffer pixel
+  uint16_t  coverage_words;           // per row
+  uint16_t  coverage_rows;
+  void render_sprite(Sprite* sprite, uint16_t _row1 = 0, uint16_t _row2 = 239);
 };
 
 #endif
@@ -0,0 +1,221 @@
+#include "convert.h"
+
+/*******************************************************************
+ SIMD helpers: Cortex-M7 SIMD instructions, plain C elsewhere
+*******************************************************************/
+// 4 unsigned bytes added with saturation at 255
+static inline uint32_t add_sat8(uint32_t a, uint32_t b)
+{
+#if defined(__ARM_FEATURE_DSP)
+  uint32_t out;
+  asm volatile("uqadd8 %0, %1, %2" : "=r" (out) : "r" (a), "r" (b));
+  return out;
+#else
+  uint32_t out = 0;
+  for (int i=0; i<32; i+=8) {
+    uint32_t s = ((a >> i) & 0xff) + ((b >> i) & 0xff);
+    out |= (s > 0xff ? 0xff : s) << i;
+  }
+  return out;
+#endif
+}
+
+// 0x00BBGGRR to RGB332
+static inline uint32_t quant888(uint32_t px)
+{
+  return (px & 0xe0) | ((px >> 11) & 0x1c) | ((px >> 22) & 0x03);
+}
+
+// 0x00BBGGRR plus threshold to RGB332: R and G are first scaled by 7/8,
+// B by 3/4 (v - v/8, v - v/4 per byte, no borrow) so that 255 maps to
+// the top level, then the threshold is added with saturation
+static inline uint32_t dither888(uint32_t px, uint32_t thr)
+{
+  px -= ((px >> 3) & 0x001f1f) | ((px >> 2) & 0x3f0000);
+  return quant888(add_sat8(px, thr));
+}
+
+// 2 RGB565 pixels (one per halfword) to RGB332 in bits 0-7 and 8-15
+static inline uint32_t quant565x2(uint32_t w)
+{
+  uint32_t c = ((w >> 8) & 0x00e000e0) | ((w >> 6) & 0x001c001c) | ((w >> 3) & 0x00030003);
+  return (c | (c >> 8)) & 0xffff;
+}
+
+
+/*******************************************************************
+ Dither tables
+*******************************************************************/
+static const uint8_t bayer4[16] = {
+   0,  8,  2, 10,
+  12,  4, 14,  6,
+   3, 11,  1,  9,
+  15,  7, 13,  5
+};
+
+static bool     tables_ready = false;
+// per 4x4 cell: RGB565 component to positioned RGB332 bits
+static uint8_t  dither_r[16][32];
+static uint8_t  dither_g[16][64];
+static uint8_t  dither_b[16][32];
+// per 4x4 cell: 0x00BBGGRR threshold for dither888()
+static uint32_t dither_888[16];
+
+// level 0..levels of v (0..255) for bayer cell value b: levels are spread
+// over the full DAC range, b/16 of a step is added before truncating
+static inline uint8_t dither_level(int v, int levels, int b)
+{
+  int k = (v*levels*32 + (2*b+1)*255) / (255*32);
+  return k > levels ? levels : k;
+}
+
+FLASHMEM void Convert::begin()
+{
+  for (int cell=0; cell<16; cell++) {
+    int b = bayer4[cell];
+    for (int v=0; v<32; v++) {
+      int v8 = (v << 3) | (v >> 2);
+      dither_r[cell][v] = dither_level(v8, 7, b) << 5;
+      dither_b[cell][v] = dither_level(v8, 3, b);
+    }
+    for (int v=0; v<64; v++) {
+      int v8 = (v << 2) | (v >> 4);
+      dither_g[cell][v] = dither_level(v8, 7, b) << 2;
+    }
+    // same in SWAR form: see dither888()
+    int t3 = 2*b + 1;
+    int t2 = 4*b + 2;
+    dither_888[cell] = t3 | (t3 << 8) | (t2 << 16);
+  }
+  tables_ready = true;
+}
+
+
+/*******************************************************************
+ Kernels
+*******************************************************************/
+void Convert::rgb565(const uint16_t * src, vga_pixel * dst, int count)
+{
+#ifndef CONVERT_332
+  while (count-- > 0) *dst++ = pixel565(*src++);
+#else
+  // align the destination for word stores
+  while ( (count > 0) && ((uint32_t)dst & 3) ) {
+    *dst++ = pixel565(*src++);
+    count--;
+  }
+  uint32_t * dst32 = (uint32_t *)dst;
+  while (count >= 4) {
+    uint32_t w0 = src[0] | ((uint32_t)src[1] << 16);
+    uint32_t w1 = src[2] | ((uint32_t)src[3] << 16);
+    *dst32++ = quant565x2(w0) | (quant565x2(w1) << 16);
+    src += 4;
+    count -= 4;
+  }
+  dst = (vga_pixel *)dst32;
+  while (count-- > 0) {
+    *dst++ = pixel565(*src++);
+  }
+#endif
+}
+
+void Convert::rgb888(const uint8_t * src, vga_pixel * dst, int count)
+{
+#ifndef CONVERT_332
+  while (count-- > 0) {
+    *dst++ = vga_format::rgb(src[0], src[1], src[2]);
+    src += 3;
+  }
+#else
+  while ( (count > 0) && ((uint32_t)dst & 3) ) {
+    *dst++ = quant888(src[0] | (src[1] << 8) | (src[2] << 16));
+    src += 3;
+    count--;
+  }
+  uint32_t * dst32 = (uint32_t *)dst;
+  while (count >= 4) {
+    // R0 G0 B0 R1 | G1 B1 R2 G2 | B2 R3 G3 B3
+    uint32_t w[3];
+    memcpy(w, src, 12);
+    uint32_t p0 = w[0];
+    uint32_t p1 = (w[0] >> 24) | (w[1] << 8);
+    uint32_t p2 = (w[1] >> 16) | (w[2] << 16);
+    uint32_t p3 = w[2] >> 8;
+    *dst32++ = quant888(p0) | (quant888(p1) << 8) | (quant888(p2) << 16) | (quant888(p3) << 24);
+    src += 12;
+    count -= 4;
+  }
+  dst = (vga_pixel *)dst32;
+  while (count-- > 0) {
+    *dst++ = quant888(src[0] | (src[1] << 8) | (src[2] << 16));
+    src += 3;
+  }
+#endif
+}
+
+void Convert::rgb565_dither(const uint16_t * src, vga_pixel * dst, int count, int x, int y)
+{
+#ifndef CONVERT_332
+  rgb565(src, dst, count);
+#else
+  if (!tables_ready) begin();
+  int row = (y & 3) << 2;
+  while ( (count > 0) && ((uint32_t)dst & 3) ) {
+    int cell = row | (x++ & 3);
+    uint16_t pix = *src++;
+    *dst++ = dither_r[cell][pix >> 11] | dither_g[cell][(pix >> 5) & 0x3f] | dither_b[cell][pix & 0x1f];
+    count--;
+  }
+  // the 4 cells of an iteration are fixed for the whole row
+  int c0 = row | ((x+0) & 3), c1 = row | ((x+1) & 3), c2 = row | ((x+2) & 3), c3 = row | ((x+3) & 3);
+  uint32_t * dst32 = (uint32_t *)dst;
+  while (count >= 4) {
+    uint16_t a = src[0], b = src[1], c = src[2], d = src[3];
+    *dst32++ = (dither_r[c0][a >> 11] | dither_g[c0][(a >> 5) & 0x3f] | dither_b[c0][a & 0x1f])
+             | ((dither_r[c1][b >> 11] | dither_g[c1][(b >> 5) & 0x3f] | dither_b[c1][b & 0x1f]) << 8)
+             | ((dither_r[c2][c >> 11] | dither_g[c2][(c >> 5) & 0x3f] | dither_b[c2][c & 0x1f]) << 16)
+             | ((uint32_t)(dither_r[c3][d >> 11] | dither_g[c3][(d >> 5) & 0x3f] | dither_b[c3][d & 0x1f]) << 24);
+    src += 4;
+    count -= 4;
+  }
+  dst = (vga_pixel *)dst32;
+  while (count-- > 0) {
+    int cell = row | (x++ & 3);
+    uint16_t pix = *src++;
+    *dst++ = dither_r[cell][pix >> 11] | dither_g[cell][(pix >> 5) & 0x3f] | dither_b[cell][pix & 0x1f];
+  }
+#endif
+}
+
+void Convert::rgb888_dither(const uint8_t * src, vga_pixel * dst, int count, int x, int y)
+{
+#ifndef CONVERT_332
+  rgb888(src, dst, count);
+#else
+  if (!tables_ready) begin();
+  const uint32_t * thr = &dither_888[(y & 3) << 2];
+  while ( (count > 0) && ((uint32_t)dst & 3) ) {
+    *dst++ = dither888(src[0] | (src[1] << 8) | (src[2] << 16), thr[x++ & 3]);
+    src += 3;
+    count--;
+  }
+  uint32_t t0 = thr[(x+0) & 3], t1 = thr[(x+1) & 3], t2 = thr[(x+2) & 3], t3 = thr[(x+3) & 3];
+  uint32_t * dst32 = (uint32_t *)dst;
+  while (count >= 4) {
+    uint32_t w[3];
+    memcpy(w, src, 12);
+    uint32_t p0 = w[0] & 0xffffff;
+    uint32_t p1 = ((w[0] >> 24) | (w[1] << 8)) & 0xffffff;
+    uint32_t p2 = ((w[1] >> 16) | (w[2] << 16)) & 0xffffff;
+    uint32_t p3 = w[2] >> 8;
+    *dst32++ = dither888(p0, t0) | (dither888(p1, t1) << 8) | (dither888(p2, t2) << 16) | (dither888(p3, t3) << 24);
+    src += 12;
+    count -= 4;
+  }
+  dst = (vga_pixel *)dst32;
+  while (count-- > 0) {
+    *dst++ = dither888(src[0] | (src[1] << 8) | (src[2] << 16), thr[x++ & 3]);
+    src += 3;
+  }
+#endif
+}
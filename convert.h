@@ -0,0 +1,37 @@
+#ifndef _CONVERT_H
+#define _CONVERT_H
+
+#include "VGA_t4.h"
+
+// Bulk RGB565 / RGB888 to vga_pixel (RGB332) conversion for image and
+// emulator streams, used by writeLine16/writeLine24.
+// - plain kernels convert 4 pixels per iteration with 32 bits SWAR
+//   masks (2 words of RGB565 or 3 words of RGB888 in, 1 word out)
+// - dither kernels apply a 4x4 ordered (Bayer) dither: per cell lookup
+//   tables for RGB565, one saturated byte add (UQADD8) per pixel for RGB888
+// RGB888 is 3 bytes per pixel in R,G,B order.
+// The kernels are RGB332 specific: other vga_format (BITS12, TIRRGGBB)
+// convert one pixel at a time through the format trait, undithered.
+
+#if !defined(BITS12) && !defined(TIRRGGBB)
+#define CONVERT_332
+#endif
+
+class Convert {
+public:
+  // builds the dither tables, done on first use otherwise
+  static void begin();
+
+  static void rgb565(const uint16_t * src, vga_pixel * dst, int count);
+  static void rgb888(const uint8_t * src, vga_pixel * dst, int count);
+  // x,y: screen position of src[0], selects the dither cells
+  static void rgb565_dither(const uint16_t * src, vga_pixel * dst, int count, int x, int y);
+  static void rgb888_dither(const uint8_t * src, vga_pixel * dst, int count, int x, int y);
+
+  static inline vga_pixel pixel565(uint16_t pix) {
+    // for 332: VGA_RGB(R16(pix),G16(pix),B16(pix)) folded into 3 masks
+    return vga_format::from565(pix);
+  }
+};
+
+#endif
@@ -0,0 +1,54 @@
+#include <VGA_t4.h>
+#include <mixer.h>
+
+// Encodes a generated sound effect to IMA ADPCM and measures the mixer
+// cost per output frame with 1 to MIXER_MAX_CHANNELS simultaneous voices.
+
+#define SFX_LEN   8192
+
+static int16_t pcm[SFX_LEN];
+static uint8_t adpcm[SFX_LEN/2];
+static short   stream[AUDIO_SAMPLE_BUFFER_SIZE*2];
+
+static void make_sfx() {
+  // falling square sweep with a decaying envelope
+  uint32_t phase = 0;
+  for (int i=0; i<SFX_LEN; i++) {
+    uint32_t step = 0x04000000 - i*0x1000;
+    phase += step;
+    int32_t env = 16000 - (16000*i)/SFX_LEN;
+    pcm[i] = (phase & 0x80000000) ? env : -env;
+  }
+}
+
+Mixer mixer;
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial && millis() < 3000) {};
+
+  make_sfx();
+  uint32_t len = Mixer::adpcm_encode(pcm, SFX_LEN, adpcm);
+  AdpcmSample sfx = { adpcm, SFX_LEN, 11025, 0 };
+
+  Serial.print("raw bytes    : ");
+  Serial.println(sizeof(pcm));
+  Serial.print("adpcm bytes  : ");
+  Serial.println(len);
+
+  for (int voices=1; voices<=MIXER_MAX_CHANNELS; voices++) {
+    for (int c=0; c<MIXER_MAX_CHANNELS; c++) mixer.stop(c);
+    for (int c=0; c<voices; c++) mixer.play_sfx(&sfx);
+    uint32_t worst = 0;
+    for (int n=0; n<16; n++) {
+      mixer.mix(stream, AUDIO_SAMPLE_BUFFER_SIZE*2);
+      if (mixer.cycles_per_sample > worst) worst = mixer.cycles_per_sample;
+    }
+    Serial.print(voices);
+    Serial.print(" voices, worst cycles/frame : ");
+    Serial.println(worst);
+  }
+}
+
+void loop() {
+}
@@ -0,0 +1,74 @@
+#include <VGA_t4.h>
+#include <bigmap.h>
+
+// Compresses a generated 16x16 tile set with the Tilelist RLE format
+// and measures the decode cost per tile (cache misses) and per cache hit.
+
+#define NB_TILES    256
+#define TILE_PIX    (16*16)
+
+static vga_pixel tiles[NB_TILES*TILE_PIX];
+static vga_pixel packed[NB_TILES*(TILE_PIX+TILE_PIX/128+1)];
+static uint32_t  offsets[NB_TILES+1];
+
+static void make_tiles() {
+  for (int t=0; t<NB_TILES; t++) {
+    vga_pixel * tile = &tiles[t*TILE_PIX];
+    for (int i=0; i<TILE_PIX; i++) {
+      int x = i & 0xf;
+      int y = i >> 4;
+      switch (t & 3) {
+        case 0: tile[i] = t; break;                                   // flat
+        case 1: tile[i] = ((x+y) & 4) ? VGA_RGB(0,0,255) : t; break;  // diagonal stripes
+        case 2: tile[i] = (y < 8) ? VGA_RGB(0,255,0) : VGA_RGB(128,64,0); break;
+        default: tile[i] = random(0,255); break;                      // noise, worst case
+      }
+    }
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial && millis() < 3000) {};
+
+  make_tiles();
+  uint32_t len = 0;
+  for (int t=0; t<NB_TILES; t++) {
+    offsets[t] = len;
+    len += Tilelist::rle_encode(&tiles[t*TILE_PIX], TILE_PIX, &packed[len]);
+  }
+  offsets[NB_TILES] = len;
+  TileSheetRLE sheet = { NB_TILES, 16, offsets, packed };
+
+  Serial.print("raw bytes    : ");
+  Serial.println(sizeof(tiles));
+  Serial.print("packed bytes : ");
+  Serial.println(len*sizeof(vga_pixel) + sizeof(offsets));
+
+  // 1 slot: every get_tile of a new index is a miss
+  Tilelist list(&sheet, 1);
+  uint32_t t0 = ARM_DWT_CYCCNT;
+  for (int t=0; t<NB_TILES; t++) list.get_tile(t);
+  uint32_t t1 = ARM_DWT_CYCCNT;
+  Serial.print("decode cycles/tile : ");
+  Serial.println((t1-t0)/NB_TILES);
+
+  for (int t=0; t<NB_TILES; t++) {
+    if (memcmp(list.get_tile(t), &tiles[t*TILE_PIX], TILE_PIX*sizeof(vga_pixel)) != 0) {
+      Serial.print("mismatch on tile ");
+      Serial.println(t);
+    }
+  }
+
+  // hot working set that fits the cache
+  Tilelist cached(&sheet, 16);
+  for (int t=0; t<16; t++) cached.get_tile(t);
+  t0 = ARM_DWT_CYCCNT;
+  for (int n=0; n<NB_TILES; n++) cached.get_tile(n & 15);
+  t1 = ARM_DWT_CYCCNT;
+  Serial.print("hit cycles/tile    : ");
+  Serial.println((t1-t0)/NB_TILES);
+}
+
+void loop() {
+}
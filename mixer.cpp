@@ -0,0 +1,570 @@
+#include "mixer.h"
+
+/*******************************************************************
+ DSP helpers: Cortex-M7 SIMD instructions, plain C elsewhere
+*******************************************************************/
+// a.low | b.low<<16
+static inline int32_t pack_lo(int32_t a, int32_t b)
+{
+#if defined(__ARM_FEATURE_DSP)
+  int32_t out;
+  asm volatile("pkhbt %0, %1, %2, lsl #16" : "=r" (out) : "r" (a), "r" (b));
+  return out;
+#else
+  return (a & 0xffff) | (b << 16);
+#endif
+}
+
+// a.high | b.high<<16
+static inline int32_t pack_hi(int32_t a, int32_t b)
+{
+#if defined(__ARM_FEATURE_DSP)
+  int32_t out;
+  asm volatile("pkhtb %0, %1, %2, asr #16" : "=r" (out) : "r" (b), "r" (a));
+  return out;
+#else
+  return ((uint32_t)a >> 16) | (b & 0xffff0000);
+#endif
+}
+
+// acc + a.low*b.low + a.high*b.high
+static inline int32_t mac_dual(int32_t a, int32_t b, int32_t acc)
+{
+#if defined(__ARM_FEATURE_DSP)
+  int32_t out;
+  asm volatile("smlad %0, %1, %2, %3" : "=r" (out) : "r" (a), "r" (b), "r" (acc));
+  return out;
+#else
+  return acc + (int16_t)a * (int16_t)b + (a >> 16) * (b >> 16);
+#endif
+}
+
+// a + b clamped to the int32 range
+static inline int32_t add_sat(int32_t a, int32_t b)
+{
+#if defined(__ARM_FEATURE_DSP)
+  int32_t out;
+  asm volatile("qadd %0, %1, %2" : "=r" (out) : "r" (a), "r" (b));
+  return out;
+#else
+  int64_t s = (int64_t)a + b;
+  if (s > INT32_MAX) return INT32_MAX;
+  if (s < INT32_MIN) return INT32_MIN;
+  return (int32_t)s;
+#endif
+}
+
+static inline int32_t sat16(int32_t a)
+{
+#if defined(__ARM_FEATURE_DSP)
+  int32_t out;
+  asm volatile("ssat %0, #16, %1" : "=r" (out) : "r" (a));
+  return out;
+#else
+  if (a > 32767) return 32767;
+  if (a < -32768) return -32768;
+  return a;
+#endif
+}
+
+
+static Mixer * active_mixer = NULL;
+
+static int16_t mix_chan[MIXER_MAX_CHANNELS+1][MIXER_BLOCK] __attribute__((aligned(4)));
+static int32_t mix_left[MIXER_BLOCK];
+static int32_t mix_right[MIXER_BLOCK];
+
+#define SAMPLE_RATE ((uint32_t)AUDIO_SAMPLE_RATE_EXACT)
+
+static uint32_t phase_step(uint32_t _freq_hz) {
+  return (uint32_t)(((uint64_t)_freq_hz << 32) / SAMPLE_RATE);
+}
+
+Mixer::Mixer(uint8_t _num_channels) {
+  num_channels = (_num_channels > MIXER_MAX_CHANNELS) ? MIXER_MAX_CHANNELS : _num_channels;
+  cycles_per_sample = 0;
+  for (uint8_t c=0; c<MIXER_MAX_CHANNELS; c++) {
+    MixerChannel * chan = &channels[c];
+    chan->wave   = MIXER_OFF;
+    chan->volume = 255;
+    chan->pan    = 0;
+    chan->loop   = false;
+    chan->data   = NULL;
+    chan->length = 0;
+    chan->shift  = 0;
+    chan->pos    = 0;
+    chan->step   = 0;
+    chan->lfsr   = 0xace1;
+    chan->adpcm  = NULL;
+    update_gains(chan);
+  }
+}
+
+void Mixer::begin(VGA_T4* _vga, int _samplesize, vga_audio_sync_t _sync) {
+  active_mixer = this;
+  _vga->begin_audio(_samplesize, &Mixer::fill, _sync);
+}
+
+void Mixer::fill(short* _stream, int _len) {
+  if (active_mixer != NULL) active_mixer->mix(_stream, _len);
+}
+
+void Mixer::update_gains(MixerChannel* _chan) {
+  int32_t pan = (_chan->pan < -127) ? -127 : _chan->pan;
+  _chan->gain_l = (_chan->volume * 128 * (127 - pan)) / 254;
+  _chan->gain_r = (_chan->volume * 128 * (127 + pan)) / 254;
+}
+
+void Mixer::play_square(uint8_t _ch, uint32_t _freq_hz) {
+  if (_ch >= num_channels) return;
+  channels[_ch].step = phase_step(_freq_hz);
+  channels[_ch].wave = MIXER_SQUARE;
+}
+
+void Mixer::play_noise(uint8_t _ch, uint32_t _freq_hz) {
+  if (_ch >= num_channels) return;
+  channels[_ch].step = phase_step(_freq_hz);
+  channels[_ch].wave = MIXER_NOISE;
+}
+
+void Mixer::play_wavetable(uint8_t _ch, const int16_t* _table, uint16_t _length, uint32_t _freq_hz) {
+  if (_ch >= num_channels) return;
+  // pos >> shift must stay inside the table: a power of 2, 2 entries at least
+  if ( (_length < 2) || (_length & (_length - 1)) ) return;
+  uint8_t bits = 0;
+  while ((1u << bits) < _length) bits++;
+  channels[_ch].wave  = MIXER_OFF;
+  channels[_ch].data  = _table;
+  channels[_ch].shift = 32 - bits;
+  channels[_ch].pos   = 0;
+  channels[_ch].step  = phase_step(_freq_hz);
+  channels[_ch].wave  = MIXER_WAVETABLE;
+}
+
+// _length up to 2^20 samples
+void Mixer::play_pcm(uint8_t _ch, const int16_t* _pcm, uint32_t _length, uint32_t _rate_hz, bool _loop) {
+  if (_ch >= num_channels) return;
+  channels[_ch].wave   = MIXER_OFF;
+  channels[_ch].data   = _pcm;
+  channels[_ch].length = _length;
+  channels[_ch].loop   = _loop;
+  channels[_ch].pos    = 0;
+  channels[_ch].step   = ((uint64_t)_rate_hz << MIXER_PCM_FRAC) / SAMPLE_RATE;
+  channels[_ch].wave   = MIXER_PCM;
+}
+
+void Mixer::play_adpcm(uint8_t _ch, const AdpcmSample* _sample, bool _loop) {
+  if (_ch >= num_channels) return;
+  uint32_t step = ((uint64_t)_sample->rate_hz << MIXER_PCM_FRAC) / SAMPLE_RATE;
+  // keeps the decode cost per mix block bounded
+  if (step > (MIXER_ADPCM_MAX_RATE << MIXER_PCM_FRAC)) step = MIXER_ADPCM_MAX_RATE << MIXER_PCM_FRAC;
+  channels[_ch].wave   = MIXER_OFF;
+  channels[_ch].adpcm  = _sample;
+  channels[_ch].length = _sample->length;
+  channels[_ch].loop   = _loop;
+  channels[_ch].pos    = 0;
+  channels[_ch].step   = step;
+  adpcm_reset(&channels[_ch]);
+  channels[_ch].wave   = MIXER_ADPCM;
+}
+
+int Mixer::play_sfx(const AdpcmSample* _sample, uint8_t _volume, int8_t _pan) {
+  for (uint8_t c=0; c<num_channels; c++) {
+    if (channels[c].wave == MIXER_OFF) {
+      channels[c].volume = _volume;
+      channels[c].pan    = _pan;
+      update_gains(&channels[c]);
+      play_adpcm(c, _sample, false);
+      return c;
+    }
+  }
+  return -1;
+}
+
+void Mixer::stop(uint8_t _ch) {
+  if (_ch >= num_channels) return;
+  channels[_ch].wave = MIXER_OFF;
+}
+
+void Mixer::set_volume(uint8_t _ch, uint8_t _volume) {
+  if (_ch >= num_channels) return;
+  channels[_ch].volume = _volume;
+  update_gains(&channels[_ch]);
+}
+
+void Mixer::set_pan(uint8_t _ch, int8_t _pan) {
+  if (_ch >= num_channels) return;
+  channels[_ch].pan = _pan;
+  update_gains(&channels[_ch]);
+}
+
+void Mixer::set_frequency(uint8_t _ch, uint32_t _freq_hz) {
+  if (_ch >= num_channels) return;
+  if (channels[_ch].wave == MIXER_PCM) {
+    channels[_ch].step = ((uint64_t)_freq_hz << MIXER_PCM_FRAC) / SAMPLE_RATE;
+  }
+  else {
+    channels[_ch].step = phase_step(_freq_hz);
+  }
+}
+
+void Mixer::set_pitch(uint8_t _ch, uint32_t _step) {
+  if (_ch >= num_channels) return;
+  channels[_ch].step = _step;
+}
+
+void Mixer::render(MixerChannel* _chan, int16_t* _dst, int _frames) {
+  uint32_t pos  = _chan->pos;
+  uint32_t step = _chan->step;
+  int i;
+  switch (_chan->wave) {
+    case MIXER_SQUARE:
+      for (i=0; i<_frames; i++) {
+        _dst[i] = (pos & 0x80000000) ? -32767 : 32767;
+        pos += step;
+      }
+      break;
+    case MIXER_NOISE: {
+      uint16_t lfsr = _chan->lfsr;
+      for (i=0; i<_frames; i++) {
+        uint32_t prev = pos;
+        pos += step;
+        if (pos < prev) lfsr = (lfsr >> 1) ^ (-(lfsr & 1) & 0xb400);
+        _dst[i] = (lfsr & 1) ? 32767 : -32767;
+      }
+      _chan->lfsr = lfsr;
+      break;
+    }
+    case MIXER_WAVETABLE: {
+      const int16_t * table = _chan->data;
+      uint8_t shift = _chan->shift;
+      for (i=0; i<_frames; i++) {
+        _dst[i] = table[pos >> shift];
+        pos += step;
+      }
+      break;
+    }
+    case MIXER_ADPCM: {
+      uint32_t end = _chan->length << MIXER_PCM_FRAC;
+      for (i=0; i<_frames; i++) {
+        if (pos >= end) {
+          if (!_chan->loop) {
+            _chan->wave = MIXER_OFF;
+            break;
+          }
+          pos -= end;
+          adpcm_reset(_chan);
+        }
+        adpcm_decode(_chan, pos >> MIXER_PCM_FRAC);
+        _dst[i] = _chan->adpcm_pred;
+        pos += step;
+      }
+      for (; i<_frames; i++) _dst[i] = 0;
+      break;
+    }
+    case MIXER_PCM: {
+      const int16_t * pcm = _chan->data;
+      uint32_t end = _chan->length << MIXER_PCM_FRAC;
+      for (i=0; i<_frames; i++) {
+        if (pos >= end) {
+          if (!_chan->loop) {
+            _chan->wave = MIXER_OFF;
+            break;
+          }
+          pos -= end;
+        }
+        _dst[i] = pcm[pos >> MIXER_PCM_FRAC];
+        pos += step;
+      }
+      for (; i<_frames; i++) _dst[i] = 0;
+      break;
+    }
+    default:
+      memset((void*)_dst, 0, _frames*sizeof(int16_t));
+      break;
+  }
+  _chan->pos = pos;
+}
+
+void Mixer::mix(short* _stream, int _len) {
+#ifdef ARM_DWT_CYCCNT
+  uint32_t start = ARM_DWT_CYCCNT;
+#endif
+  int frames = _len >> 1;
+  int total  = frames;
+  uint32_t * out = (uint32_t *)_stream;
+
+  uint8_t active[MIXER_MAX_CHANNELS];
+  int nb_active = 0;
+  for (uint8_t c=0; c<num_channels; c++) {
+    if ( (channels[c].wave != MIXER_OFF) && (channels[c].volume != 0) ) active[nb_active++] = c;
+  }
+  memset((void*)mix_chan[MIXER_MAX_CHANNELS], 0, sizeof(mix_chan[0]));
+
+  while (frames > 0) {
+    int block = (frames > MIXER_BLOCK) ? MIXER_BLOCK : frames;
+    memset((void*)mix_left, 0, sizeof(mix_left));
+    memset((void*)mix_right, 0, sizeof(mix_right));
+
+    // 2 channels per pass: one SMLAD per output side sums both, a pair
+    // (2 x 32767 x 32640 at most) fits in 32 bits, the passes are added
+    // with saturation (QADD) so loud mixes clip instead of wrapping
+    for (int p=0; p<nb_active; p+=2) {
+      MixerChannel * a = &channels[active[p]];
+      int16_t * buf_a = mix_chan[p];
+      int16_t * buf_b = mix_chan[MIXER_MAX_CHANNELS];
+      int32_t gain_l = (uint16_t)a->gain_l;
+      int32_t gain_r = (uint16_t)a->gain_r;
+      render(a, buf_a, block);
+      if (p+1 < nb_active) {
+        MixerChannel * b = &channels[active[p+1]];
+        buf_b = mix_chan[p+1];
+        render(b, buf_b, block);
+        gain_l = pack_lo(a->gain_l, b->gain_l);
+        gain_r = pack_lo(a->gain_r, b->gain_r);
+      }
+      const uint32_t * wa = (const uint32_t *)buf_a;
+      const uint32_t * wb = (const uint32_t *)buf_b;
+      for (int i=0; i<block; i+=2) {
+        int32_t xa = *wa++;
+        int32_t xb = *wb++;
+        int32_t s0 = pack_lo(xa, xb);
+        int32_t s1 = pack_hi(xa, xb);
+        mix_left[i]    = add_sat(mix_left[i],    mac_dual(s0, gain_l, 0));
+        mix_right[i]   = add_sat(mix_right[i],   mac_dual(s0, gain_r, 0));
+        mix_left[i+1]  = add_sat(mix_left[i+1],  mac_dual(s1, gain_l, 0));
+        mix_right[i+1] = add_sat(mix_right[i+1], mac_dual(s1, gain_r, 0));
+      }
+    }
+
+    for (int i=0; i<block; i++) {
+      *out++ = pack_lo(sat16(mix_left[i] >> 15), sat16(mix_right[i] >> 15));
+    }
+    frames -= block;
+  }
+
+#ifdef ARM_DWT_CYCCNT
+  if (total > 0) cycles_per_sample = (ARM_DWT_CYCCNT - start) / total;
+#endif
+}
+
+
+/*******************************************************************
+ IMA ADPCM
+*******************************************************************/
+static const int16_t adpcm_steps[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+  11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+  32767
+};
+
+static const int8_t adpcm_index_adjust[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+// decodes one nibble, updating predictor and index in place
+static inline void adpcm_nibble(uint8_t _n, int32_t* _pred, int32_t* _index)
+{
+  int32_t step = adpcm_steps[*_index];
+  int32_t diff = step >> 3;
+  if (_n & 1) diff += step >> 2;
+  if (_n & 2) diff += step >> 1;
+  if (_n & 4) diff += step;
+  int32_t pred = (_n & 8) ? *_pred - diff : *_pred + diff;
+  if (pred > 32767) pred = 32767;
+  else if (pred < -32768) pred = -32768;
+  int32_t index = *_index + adpcm_index_adjust[_n];
+  if (index < 0) index = 0;
+  else if (index > 88) index = 88;
+  *_pred  = pred;
+  *_index = index;
+}
+
+void Mixer::adpcm_reset(MixerChannel* _chan) {
+  _chan->adpcm_ptr   = _chan->adpcm->data;
+  _chan->adpcm_next  = 0;
+  _chan->adpcm_k     = 0;
+  _chan->adpcm_pred  = 0;
+  _chan->adpcm_index = 0;
+}
+
+// decodes forward until sample _upto is the current one in adpcm_pred
+void Mixer::adpcm_decode(MixerChannel* _chan, uint32_t _upto) {
+  if (_chan->adpcm_next > _upto) return;
+  const uint8_t * ptr = _chan->adpcm_ptr;
+  uint16_t block_size = _chan->adpcm->block_size;
+  uint16_t per_block  = (block_size > 4) ? (block_size-4)*2+1 : 0;
+  uint32_t next  = _chan->adpcm_next;
+  uint16_t k     = _chan->adpcm_k;
+  int32_t  pred  = _chan->adpcm_pred;
+  int32_t  index = _chan->adpcm_index;
+  while (next <= _upto) {
+    if (per_block == 0) {
+      uint8_t n = (next & 1) ? (*ptr++ >> 4) : (*ptr & 0xf);
+      adpcm_nibble(n, &pred, &index);
+    }
+    else {
+      if (k == 0) {
+        pred  = (int16_t)(ptr[0] | (ptr[1] << 8));
+        index = (ptr[2] > 88) ? 88 : ptr[2];
+        ptr += 4;
+      }
+      else {
+        uint8_t n = (k & 1) ? (*ptr & 0xf) : (*ptr++ >> 4);
+        adpcm_nibble(n, &pred, &index);
+      }
+      if (++k == per_block) k = 0;
+    }
+    next++;
+  }
+  _chan->adpcm_ptr   = ptr;
+  _chan->adpcm_next  = next;
+  _chan->adpcm_k     = k;
+  _chan->adpcm_pred  = pred;
+  _chan->adpcm_index = index;
+}
+
+uint32_t Mixer::adpcm_encode(const int16_t* _pcm, uint32_t _length, uint8_t* _out) {
+  int32_t pred  = 0;
+  int32_t index = 0;
+  for (uint32_t i=0; i<_length; i++) {
+    int32_t step = adpcm_steps[index];
+    int32_t diff = _pcm[i] - pred;
+    uint8_t n = 0;
+    if (diff < 0) {
+      n = 8;
+      diff = -diff;
+    }
+    if (diff >= step) { n |= 4; diff -= step; }
+    step >>= 1;
+    if (diff >= step) { n |= 2; diff -= step; }
+    step >>= 1;
+    if (diff >= step) { n |= 1; }
+    // track the decoder state so errors do not accumulate
+    adpcm_nibble(n, &pred, &index);
+    if (i & 1) _out[i>>1] |= n << 4;
+    else _out[i>>1] = n;
+  }
+  return (_length+1) >> 1;
+}
+
+
+/*******************************************************************
+ SPSC ring buffer between game loop and audio refill
+*******************************************************************/
+static AudioRing * active_ring = NULL;
+
+// data must be visible before the index that publishes it
+static inline void ring_barrier()
+{
+#if defined(__arm__)
+  asm volatile("dmb" ::: "memory");
+#else
+  __sync_synchronize();
+#endif
+}
+
+AudioRing::AudioRing(uint32_t _size, vga_mem_t _mem) {
+  size = 2;
+  while (size < _size) size <<= 1;
+  head       = 0;
+  tail       = 0;
+  underruns  = 0;
+  high_water = 0;
+  buffer = (int16_t*) VGA_T4::mem_alloc(VGA_BUF_AUDIO, size*sizeof(int16_t), _mem);
+  if (buffer == NULL) {
+    Serial.println("could not allocate audio ring");
+    size = 0;
+  }
+}
+
+void AudioRing::begin(VGA_T4* _vga, int _samplesize, vga_audio_sync_t _sync) {
+  active_ring = this;
+  _vga->begin_audio(_samplesize, &AudioRing::fill, _sync);
+}
+
+void AudioRing::fill(short* _stream, int _len) {
+  if (active_ring != NULL) active_ring->read(_stream, _len);
+}
+
+uint32_t AudioRing::available() {
+  return head - tail;
+}
+
+uint32_t AudioRing::space() {
+  return size - (head - tail);
+}
+
+uint32_t AudioRing::write(const int16_t* _samples, uint32_t _count) {
+  uint32_t h = head;
+  uint32_t n = size - (h - tail);
+  if (_count < n) n = _count;
+  // whole stereo frames only, head stays even for produce()
+  n &= ~1;
+  uint32_t idx   = h & (size-1);
+  uint32_t first = (idx + n > size) ? size - idx : n;
+  memcpy((void*)&buffer[idx], (const void*)_samples, first*sizeof(int16_t));
+  memcpy((void*)&buffer[0], (const void*)&_samples[first], (n-first)*sizeof(int16_t));
+  ring_barrier();
+  head = h + n;
+  uint32_t level = head - tail;
+  if (level > high_water) high_water = level;
+  return n;
+}
+
+uint32_t AudioRing::produce(void (*_generate)(short* _stream, int _len)) {
+  uint32_t total = 0;
+  // generate straight into the ring, one contiguous even span at a time
+  for (int pass=0; pass<2; pass++) {
+    uint32_t h   = head;
+    uint32_t n   = (size - (h - tail)) & ~1;
+    uint32_t idx = h & (size-1);
+    if (idx + n > size) n = size - idx;
+    if (n == 0) break;
+    _generate((short*)&buffer[idx], n);
+    ring_barrier();
+    head = h + n;
+    total += n;
+  }
+  uint32_t level = head - tail;
+  if (level > high_water) high_water = level;
+  return total;
+}
+
+static Mixer * producer_mixer = NULL;
+
+static void mixer_generate(short* _stream, int _len) {
+  producer_mixer->mix(_stream, _len);
+}
+
+uint32_t AudioRing::produce(Mixer* _mixer) {
+  producer_mixer = _mixer;
+  return produce(&mixer_generate);
+}
+
+uint32_t AudioRing::read(int16_t* _dst, uint32_t _count) {
+  uint32_t t = tail;
+  uint32_t n = head - t;
+  if (_count < n) n = _count;
+  ring_barrier();
+  uint32_t idx   = t & (size-1);
+  uint32_t first = (idx + n > size) ? size - idx : n;
+  memcpy((void*)_dst, (const void*)&buffer[idx], first*sizeof(int16_t));
+  memcpy((void*)&_dst[first], (const void*)&buffer[0], (n-first)*sizeof(int16_t));
+  ring_barrier();
+  tail = t + n;
+  if (n < _count) {
+    memset((void*)&_dst[n], 0, (_count-n)*sizeof(int16_t));
+    underruns++;
+  }
+  return n;
+}
+
+void AudioRing::reset_stats() {
+  underruns  = 0;
+  high_water = head - tail;
+}
@@ -0,0 +1,130 @@
+#ifndef _MIXER_H
+#define _MIXER_H
+
+#include "VGA_t4.h"
+
+// Fixed point multi-channel mixer for begin_audio()
+// - square, noise, wavetable, PCM and IMA ADPCM channels
+// - volume 0..255, pan -127 (left) .. 127 (right)
+// - pitch as 32bits phase step (oscillators) or 20.12 sample step (PCM)
+// Channels are mixed in pairs with the Cortex-M7 dual 16x16 MAC (SMLAD).
+
+#define MIXER_MAX_CHANNELS  8
+#define MIXER_BLOCK         64    // frames rendered per pass
+#define MIXER_PCM_FRAC      12
+#define MIXER_ADPCM_MAX_RATE 2    // ADPCM decodes at most 2 samples per output frame
+
+typedef enum mixer_wave_t
+{
+  MIXER_OFF       = 0,
+  MIXER_SQUARE    = 1,
+  MIXER_NOISE     = 2,
+  MIXER_WAVETABLE = 3,
+  MIXER_PCM       = 4,
+  MIXER_ADPCM     = 5
+} mixer_wave_t;
+
+// IMA ADPCM (4 bits per sample, low nibble first), mono
+// block_size 0: one raw stream starting at predictor 0, index 0
+// block_size n: WAV style blocks of n bytes, each starting with a 4 bytes
+//               header (int16 predictor, uint8 index, 0) holding the first sample
+typedef struct {
+  const uint8_t* data;
+  uint32_t       length;      // in samples
+  uint16_t       rate_hz;
+  uint16_t       block_size;
+} AdpcmSample;
+
+typedef struct {
+  uint8_t        wave;
+  uint8_t        volume;
+  int8_t         pan;
+  bool           loop;
+  const int16_t* data;      // wavetable or PCM samples
+  uint32_t       length;    // PCM length in samples
+  uint8_t        shift;     // 32 - log2(wavetable length)
+  uint32_t       pos;       // phase or PCM position
+  uint32_t       step;      // pitch
+  uint16_t       lfsr;      // noise state
+  const AdpcmSample* adpcm;
+  const uint8_t* adpcm_ptr; // next ADPCM byte
+  uint32_t       adpcm_next;// next ADPCM sample to decode
+  uint16_t       adpcm_k;   // sample position in the current block
+  int16_t        adpcm_pred;
+  int8_t         adpcm_index;
+  int16_t        gain_l;    // Q15 gains from volume and pan
+  int16_t        gain_r;
+} MixerChannel;
+
+class Mixer {
+public:
+  uint8_t      num_channels;
+  MixerChannel channels[MIXER_MAX_CHANNELS];
+  uint32_t     cycles_per_sample;   // cost of the last mix() per output frame
+
+  Mixer(uint8_t _num_channels = MIXER_MAX_CHANNELS);
+  // install as the begin_audio() callback
+  void begin(VGA_T4* _vga, int _samplesize = AUDIO_SAMPLE_BUFFER_SIZE, vga_audio_sync_t _sync = AUDIO_SYNC_NONE);
+
+  void play_square(uint8_t _ch, uint32_t _freq_hz);
+  void play_noise(uint8_t _ch, uint32_t _freq_hz);
+  // _length must be a power of 2 from 2 to 32768 (else ignored), _freq_hz is
+  // the rate of one table period
+  void play_wavetable(uint8_t _ch, const int16_t* _table, uint16_t _length, uint32_t _freq_hz);
+  void play_pcm(uint8_t _ch, const int16_t* _pcm, uint32_t _length, uint32_t _rate_hz, bool _loop);
+  void play_adpcm(uint8_t _ch, const AdpcmSample* _sample, bool _loop);
+  // sound effect on the first free channel, returns it or -1 if all are busy
+  int  play_sfx(const AdpcmSample* _sample, uint8_t _volume = 255, int8_t _pan = 0);
+  void stop(uint8_t _ch);
+
+  void set_volume(uint8_t _ch, uint8_t _volume);
+  void set_pan(uint8_t _ch, int8_t _pan);
+  void set_frequency(uint8_t _ch, uint32_t _freq_hz);
+  void set_pitch(uint8_t _ch, uint32_t _step);
+
+  // stereo interleaved, len in shorts (begin_audio callback convention)
+  void mix(short* _stream, int _len);
+  static void fill(short* _stream, int _len);
+
+  // raw stream encoder (block_size 0), returns the number of bytes written
+  static uint32_t adpcm_encode(const int16_t* _pcm, uint32_t _length, uint8_t* _out);
+
+private:
+  void update_gains(MixerChannel* _chan);
+  void adpcm_reset(MixerChannel* _chan);
+  void adpcm_decode(MixerChannel* _chan, uint32_t _upto);
+  void render(MixerChannel* _chan, int16_t* _dst, int _frames);
+};
+
+// Single producer / single consumer PCM ring buffer.
+// The game loop (producer) renders samples ahead of time with write() or
+// produce(), the audio refill interrupt (consumer) only copies them out.
+// Counts are in shorts (stereo interleaved), size must be a power of 2.
+class AudioRing {
+public:
+  int16_t*          buffer;
+  uint32_t          size;
+  volatile uint32_t head;         // advanced by the producer only
+  volatile uint32_t tail;         // advanced by the consumer only
+  volatile uint32_t underruns;    // refills that ran out of samples
+  volatile uint32_t high_water;   // highest fill level seen
+
+  AudioRing(uint32_t _size, vga_mem_t _mem = VGA_MEM_AUTO);
+  // install as the begin_audio() callback
+  void begin(VGA_T4* _vga, int _samplesize = AUDIO_SAMPLE_BUFFER_SIZE, vga_audio_sync_t _sync = AUDIO_SYNC_NONE);
+
+  uint32_t available();
+  uint32_t space();
+  // interleaved L/R samples, an odd trailing sample is not written
+  uint32_t write(const int16_t* _samples, uint32_t _count);
+  // fill all free space from a generator (e.g. a begin_audio style callback)
+  uint32_t produce(void (*_generate)(short* _stream, int _len));
+  uint32_t produce(Mixer* _mixer);
+  // consumer side, pads with silence on underrun
+  uint32_t read(int16_t* _dst, uint32_t _count);
+  void reset_stats();
+
+  static void fill(short* _stream, int _len);
+};
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _PIXFMT_H
+#define _PIXFMT_H
+
+#include <stdint.h>
+
+// Pixel format traits, one is selected at compile time as vga_format (VGA_t4.h):
+//   PixFmt332      RRRGGGBB (default), bit 7 doubles as the transparency flag
+//   PixFmtTIRRGGBB TIRRGGBB: transparency, intensity, 2 bits per component
+//   PixFmt444      GBB0RRRRGGGBB (BITS12), the unused bit 9 flags transparency
+// Each trait gives the pixel type, packing from 8 bits components and from
+// RGB565 and back, the transparency test, a per component average and the
+// pixel bits driven by FlexIO1 (hi) and FlexIO2 (lo), merged when the DMAs
+// are shifted.
+
+struct PixFmt332 {
+  typedef uint8_t pixel;
+  static const pixel trans_mask   = 0x80;
+  static const pixel flexio1_mask = 0xf0;
+  static const pixel flexio2_mask = 0x0f;
+
+  static inline pixel rgb(uint8_t r, uint8_t g, uint8_t b) {
+    return ((r >> 5) << 5) | ((g >> 5) << 2) | (b >> 6);
+  }
+  static inline pixel from565(uint16_t p) {
+    return ((p >> 8) & 0xe0) | ((p >> 6) & 0x1c) | ((p >> 3) & 0x03);
+  }
+  // the lsb shifted into the next lower component is masked out
+  static inline pixel avg(pixel a, pixel b) {
+    return (a & b) + (((a ^ b) >> 1) & 0x6d);
+  }
+  static inline bool transparent(pixel p) { return (p & trans_mask) != 0; }
+  // back to 8 bits components, rgb(decode(p)) == p
+  static inline void decode(pixel p, uint8_t * r, uint8_t * g, uint8_t * b) {
+    *r = ((p >> 5) * 255) / 7;
+    *g = (((p >> 2) & 7) * 255) / 7;
+    *b = ((p & 3) * 255) / 3;
+  }
+};
+
+struct PixFmtTIRRGGBB {
+  typedef uint8_t pixel;
+  static const pixel trans_mask   = 0x80;
+  static const pixel flexio1_mask = 0xf0;
+  static const pixel flexio2_mask = 0x0f;
+
+  // intensity set when all components are in the upper half of their level
+  static inline pixel rgb(uint8_t r, uint8_t g, uint8_t b) {
+    pixel i = ((r & g & b) >> 5) & 1;
+    return (i << 6) | ((r >> 6) << 4) | ((g >> 6) << 2) | (b >> 6);
+  }
+  static inline pixel from565(uint16_t p) {
+    return rgb((p >> 8) & 0xf8, (p >> 3) & 0xfc, (p << 3) & 0xf8);
+  }
+  // T and I are kept when set in both
+  static inline pixel avg(pixel a, pixel b) {
+    return (a & b) + (((a ^ b) >> 1) & 0x15);
+  }
+  static inline bool transparent(pixel p) { return (p & trans_mask) != 0; }
+  // middle of the lower or upper half of the level, as selected by I
+  static inline void decode(pixel p, uint8_t * r, uint8_t * g, uint8_t * b) {
+    uint8_t half = (p & 0x40) ? 48 : 16;
+    *r = (((p >> 4) & 3) << 6) + half;
+    *g = (((p >> 2) & 3) << 6) + half;
+    *b = ((p & 3) << 6) + half;
+  }
+};
+
+struct PixFmt444 {
+  typedef uint16_t pixel;
+  static const pixel trans_mask   = 0x0200;
+  static const pixel flexio1_mask = 0x01f0;   // FlexIO1 pins 4..8
+  static const pixel flexio2_mask = 0x1c0f;   // FlexIO2 pins 0..3, 10..12
+
+  static inline pixel pack(uint32_t r4, uint32_t g4, uint32_t b4) {
+    return (r4 << 5) | ((g4 & 7) << 2) | ((g4 & 8) << 9) | (b4 & 3) | ((b4 & 0xc) << 8);
+  }
+  static inline uint32_t red(pixel p)   { return (p >> 5) & 0xf; }
+  static inline uint32_t green(pixel p) { return ((p >> 2) & 7) | ((p >> 9) & 8); }
+  static inline uint32_t blue(pixel p)  { return (p & 3) | ((p >> 8) & 0xc); }
+
+  static inline pixel rgb(uint8_t r, uint8_t g, uint8_t b) {
+    return pack(r >> 4, g >> 4, b >> 4);
+  }
+  static inline pixel from565(uint16_t p) {
+    return pack(p >> 12, (p >> 7) & 0xf, (p >> 1) & 0xf);
+  }
+  // components are not contiguous: unpacked
+  static inline pixel avg(pixel a, pixel b) {
+    return pack((red(a) + red(b)) >> 1, (green(a) + green(b)) >> 1, (blue(a) + blue(b)) >> 1)
+         | (a & b & trans_mask);
+  }
+  static inline bool transparent(pixel p) { return (p & trans_mask) != 0; }
+  static inline void decode(pixel p, uint8_t * r, uint8_t * g, uint8_t * b) {
+    *r = red(p) * 17;
+    *g = green(p) * 17;
+    *b = blue(p) * 17;
+  }
+};
+
+#endif
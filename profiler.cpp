@@ -0,0 +1,95 @@
+#include "profiler.h"
+
+static volatile uint32_t prof_acc[PROF_SCOPES];
+static uint32_t prof_last[PROF_SCOPES];
+static uint32_t prof_min[PROF_SCOPES];
+static uint32_t prof_max[PROF_SCOPES];
+static uint64_t prof_total[PROF_SCOPES];
+static uint32_t prof_frames = 0;
+static uint32_t prof_frame_start = 0;
+static bool     prof_running = false;
+
+static const char * prof_names[PROF_SCOPES] = {
+  "frame", "clear", "sprites", "user", "qt3 isr", "audio isr", "wait",
+  "viewport 0", "viewport 1", "viewport 2", "viewport 3"
+};
+
+void Profiler::reset() {
+  ARM_DEMCR |= ARM_DEMCR_TRCENA;
+  ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+  for (int s=0; s<PROF_SCOPES; s++) {
+    __atomic_store_n(&prof_acc[s], 0, __ATOMIC_RELAXED);
+    prof_last[s]  = 0;
+    prof_min[s]   = 0xffffffff;
+    prof_max[s]   = 0;
+    prof_total[s] = 0;
+  }
+  prof_frames = 0;
+  prof_frame_start = ARM_DWT_CYCCNT;
+  prof_running = true;
+}
+
+// also called from interrupts, which can preempt each other
+FASTRUN void Profiler::add(uint8_t _scope, uint32_t _cycles) {
+  if (_scope >= PROF_SCOPES) _scope = PROF_SCOPES-1;
+  __atomic_fetch_add(&prof_acc[_scope], _cycles, __ATOMIC_RELAXED);
+}
+
+void Profiler::end_frame() {
+  // first frame only starts the measure
+  if (!prof_running) {
+    reset();
+    return;
+  }
+  uint32_t now = ARM_DWT_CYCCNT;
+  uint32_t frame[PROF_SCOPES];
+  for (int s=0; s<PROF_SCOPES; s++) {
+    frame[s] = __atomic_exchange_n(&prof_acc[s], 0, __ATOMIC_RELAXED);
+  }
+  frame[PROF_FRAME] = now - prof_frame_start;
+  prof_frame_start = now;
+  for (int s=0; s<PROF_SCOPES; s++) {
+    prof_last[s] = frame[s];
+    if (frame[s] < prof_min[s]) prof_min[s] = frame[s];
+    if (frame[s] > prof_max[s]) prof_max[s] = frame[s];
+    prof_total[s] += frame[s];
+  }
+  prof_frames++;
+}
+
+uint32_t Profiler::get_frames() {
+  return prof_frames;
+}
+
+void Profiler::get_stat(uint8_t _scope, prof_stat_t* _stat) {
+  if (_scope >= PROF_SCOPES || prof_frames == 0) {
+    memset((void*)_stat, 0, sizeof(prof_stat_t));
+    return;
+  }
+  _stat->last = prof_last[_scope];
+  _stat->min  = prof_min[_scope];
+  _stat->avg  = prof_total[_scope] / prof_frames;
+  _stat->max  = prof_max[_scope];
+}
+
+const char * Profiler::get_name(uint8_t _scope) {
+  return (_scope < PROF_SCOPES) ? prof_names[_scope] : "";
+}
+
+void Profiler::print() {
+  Serial.print("profile over ");
+  Serial.print(prof_frames);
+  Serial.println(" frames (us min/avg/max)");
+  for (int s=0; s<PROF_SCOPES; s++) {
+    prof_stat_t stat;
+    get_stat(s, &stat);
+    if (stat.max == 0) continue;
+    Serial.print(prof_names[s]);
+    Serial.print(" ");
+    Serial.print(stat.min / (F_CPU_ACTUAL/1000000));
+    Serial.print("/");
+    Serial.print(stat.avg / (F_CPU_ACTUAL/1000000));
+    Serial.print("/");
+    Serial.println(stat.max / (F_CPU_ACTUAL/1000000));
+  }
+}
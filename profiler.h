@@ -0,0 +1,56 @@
+#ifndef _PROFILER_H
+#define _PROFILER_H
+
+#include "VGA_t4.h"
+
+// Per frame cycle profiler built on the DWT cycle counter.
+// Hooks are only compiled in with #define VGA_PROFILE (VGA_t4.h),
+// otherwise PROFILE_START/PROFILE_STOP expand to nothing.
+//
+// Cycles are summed per scope over a frame, then folded into
+// min/avg/max at each Profiler::end_frame() (done by BigMapEngine).
+
+#define PROF_MAX_VIEWPORTS 4
+
+typedef enum prof_scope_t
+{
+  PROF_FRAME     = 0,   // whole frame, end_frame() to end_frame()
+  PROF_CLEAR     = 1,
+  PROF_SPRITES   = 2,
+  PROF_USER      = 3,   // outside render_next_frame*()
+  PROF_QT3_ISR   = 4,
+  PROF_AUDIO_ISR = 5,   // AUDIO_isr and the refill in SOFTWARE_isr
+  PROF_WAIT      = 6,   // waitLine()/waitSync() stall
+  PROF_VIEWPORT  = 7    // + viewport index, up to PROF_MAX_VIEWPORTS
+} prof_scope_t;
+
+#define PROF_SCOPES (PROF_VIEWPORT + PROF_MAX_VIEWPORTS)
+
+// cycles per frame
+typedef struct {
+  uint32_t last;
+  uint32_t min;
+  uint32_t avg;
+  uint32_t max;
+} prof_stat_t;
+
+#ifdef VGA_PROFILE
+#define PROFILE_START(t)        uint32_t t = ARM_DWT_CYCCNT
+#define PROFILE_STOP(t, scope)  Profiler::add((scope), ARM_DWT_CYCCNT - (t))
+#else
+#define PROFILE_START(t)
+#define PROFILE_STOP(t, scope)
+#endif
+
+class Profiler {
+public:
+  static void reset();
+  static void add(uint8_t _scope, uint32_t _cycles);
+  static void end_frame();
+  static uint32_t get_frames();
+  static void get_stat(uint8_t _scope, prof_stat_t* _stat);
+  static const char* get_name(uint8_t _scope);
+  static void print();
+};
+
+#endif
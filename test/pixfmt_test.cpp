@@ -0,0 +1,114 @@
+// Host test of the pixel format traits (pixfmt.h), no Teensy needed:
+//   g++ -std=c++11 -I.. pixfmt_test.cpp -o pixfmt_test && ./pixfmt_test
+// Exhaustive over each format: decode/rgb and pack/red/green/blue round
+// trips, from565, avg per component and the FlexIO pin masks.
+
+#include "pixfmt.h"
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond, fmt, ...) \
+  do { if (!(cond)) { if (failures++ < 20) printf("FAIL %s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__); } } while (0)
+
+// colour values: the transparency bit is skipped unless it is also a
+// component bit (332 uses the red msb)
+template <class F> static bool is_pixel(uint32_t p) {
+  if ((p & ~(uint32_t)(F::flexio1_mask | F::flexio2_mask | F::trans_mask)) != 0) return false;
+  return !F::transparent(p) || (F::rgb(255, 255, 255) & F::trans_mask);
+}
+
+template <class F> static void test_masks(const char* name) {
+  CHECK((F::flexio1_mask & F::flexio2_mask) == 0, "%s flexio masks overlap", name);
+  for (uint32_t r=0; r<256; r+=5) {
+    for (uint32_t g=0; g<256; g+=5) {
+      for (uint32_t b=0; b<256; b+=5) {
+        typename F::pixel p = F::rgb(r, g, b);
+        CHECK((p & ~(F::flexio1_mask | F::flexio2_mask)) == 0, "%s rgb(%u,%u,%u) outside the pins", name, r, g, b);
+      }
+    }
+  }
+}
+
+template <class F> static void test_roundtrip(const char* name, uint32_t count) {
+  for (uint32_t p=0; p<count; p++) {
+    if (!is_pixel<F>(p)) continue;
+    uint8_t r, g, b;
+    F::decode(p, &r, &g, &b);
+    CHECK(F::rgb(r, g, b) == p, "%s rgb(decode(%x)) = %x", name, p, F::rgb(r, g, b));
+  }
+  for (uint32_t c=0; c<0x10000; c++) {
+    uint8_t r = (c >> 8) & 0xf8, g = (c >> 3) & 0xfc, b = (c << 3) & 0xf8;
+    CHECK(F::from565(c) == F::rgb(r, g, b), "%s from565(%x)", name, c);
+  }
+}
+
+// component levels of a pixel, as stored
+static void levels(PixFmt332, uint32_t p, uint32_t* r, uint32_t* g, uint32_t* b) {
+  *r = (p >> 5) & 7; *g = (p >> 2) & 7; *b = p & 3;
+}
+static void levels(PixFmt444, uint32_t p, uint32_t* r, uint32_t* g, uint32_t* b) {
+  *r = PixFmt444::red(p); *g = PixFmt444::green(p); *b = PixFmt444::blue(p);
+}
+
+// each component level of avg(a,b) is the truncated mean of the levels
+template <class F> static void test_avg(const char* name, uint32_t count, uint32_t step) {
+  for (uint32_t a=0; a<count; a+=step) {
+    if (!is_pixel<F>(a)) continue;
+    for (uint32_t b=0; b<count; b+=step) {
+      if (!is_pixel<F>(b)) continue;
+      uint32_t m = F::avg(a, b);
+      uint32_t ra, ga, ba, rb, gb, bb, rm, gm, bm;
+      levels(F(), a, &ra, &ga, &ba);
+      levels(F(), b, &rb, &gb, &bb);
+      levels(F(), m, &rm, &gm, &bm);
+      CHECK(rm == (ra + rb) / 2 && gm == (ga + gb) / 2 && bm == (ba + bb) / 2,
+            "%s avg(%x,%x) = %x", name, a, b, m);
+    }
+  }
+}
+
+static void test_444_pack() {
+  for (uint32_t r=0; r<16; r++) {
+    for (uint32_t g=0; g<16; g++) {
+      for (uint32_t b=0; b<16; b++) {
+        PixFmt444::pixel p = PixFmt444::pack(r, g, b);
+        CHECK(!PixFmt444::transparent(p), "444 pack(%u,%u,%u) transparent", r, g, b);
+        CHECK(PixFmt444::red(p) == r && PixFmt444::green(p) == g && PixFmt444::blue(p) == b,
+              "444 pack(%u,%u,%u) = %x", r, g, b, p);
+      }
+    }
+  }
+  CHECK((PixFmt444::trans_mask & (PixFmt444::flexio1_mask | PixFmt444::flexio2_mask)) == 0, "444 transparency bit driven");
+  PixFmt444::pixel t = PixFmt444::pack(15, 15, 15) | PixFmt444::trans_mask;
+  CHECK(PixFmt444::transparent(PixFmt444::avg(t, t)), "444 avg drops transparency");
+  CHECK(!PixFmt444::transparent(PixFmt444::avg(t, PixFmt444::pack(0, 0, 0))), "444 avg keeps half transparency");
+}
+
+// TIRRGGBB: 2 bits per component, I only when set in both
+static void test_tirrggbb_avg() {
+  for (uint32_t a=0; a<0x80; a++) {
+    for (uint32_t b=0; b<0x80; b++) {
+      uint32_t m = PixFmtTIRRGGBB::avg(a, b);
+      for (int s=0; s<6; s+=2) {
+        CHECK(((m >> s) & 3) == ((((a >> s) & 3) + ((b >> s) & 3)) >> 1), "TIRRGGBB avg(%x,%x) = %x", a, b, m);
+      }
+      CHECK(((m >> 6) & 1) == ((a & b) >> 6 & 1), "TIRRGGBB avg(%x,%x) intensity", a, b);
+    }
+  }
+}
+
+int main() {
+  test_masks<PixFmt332>("332");
+  test_masks<PixFmtTIRRGGBB>("TIRRGGBB");
+  test_masks<PixFmt444>("444");
+  test_roundtrip<PixFmt332>("332", 0x100);
+  test_roundtrip<PixFmtTIRRGGBB>("TIRRGGBB", 0x100);
+  test_roundtrip<PixFmt444>("444", 0x2000);
+  test_avg<PixFmt332>("332", 0x100, 1);
+  test_avg<PixFmt444>("444", 0x2000, 7);
+  test_tirrggbb_avg();
+  test_444_pack();
+  printf("%s: %d failure(s)\n", failures ? "FAILED" : "OK", failures);
+  return failures ? 1 : 0;
+}
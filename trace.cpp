@@ -0,0 +1,67 @@
+#include "trace.h"
+
+static trace_event_t trace_ring[TRACE_RING_SIZE];
+static volatile uint32_t trace_head = 0;
+static volatile uint32_t trace_tail = 0;
+static volatile uint32_t trace_dropped = 0;
+
+static const char * trace_names[TRACE_IDS] = {
+  "frame", "viewport", "map row", "sprite", "bitmap row", "bitmap crop", "tile add", "deadline miss", "occlusion", "chunk overrun"
+};
+
+// a full ring drops the new event, never blocks
+void Trace::log(uint8_t _level, uint8_t _id, uint16_t _a, uint16_t _b, uint16_t _c, uint16_t _d, uint16_t _e) {
+  uint32_t h = trace_head;
+  if (h - trace_tail >= TRACE_RING_SIZE) {
+    trace_dropped++;
+    return;
+  }
+  trace_event_t * ev = &trace_ring[h & (TRACE_RING_SIZE-1)];
+  ev->stamp   = ARM_DWT_CYCCNT;
+  ev->id      = _id;
+  ev->level   = _level;
+  ev->args[0] = _a;
+  ev->args[1] = _b;
+  ev->args[2] = _c;
+  ev->args[3] = _d;
+  ev->args[4] = _e;
+  trace_head = h + 1;
+}
+
+bool Trace::read(trace_event_t* _event) {
+  uint32_t t = trace_tail;
+  if (t == trace_head) return false;
+  memcpy((void*)_event, (void*)&trace_ring[t & (TRACE_RING_SIZE-1)], sizeof(trace_event_t));
+  trace_tail = t + 1;
+  return true;
+}
+
+uint16_t Trace::drain(uint16_t _max) {
+  uint16_t n = 0;
+  trace_event_t ev;
+  while (n < _max && read(&ev)) {
+    Serial.print(ev.stamp);
+    Serial.print(" ");
+    Serial.print((ev.id < TRACE_IDS) ? trace_names[ev.id] : "?");
+    for (int i=0; i<5; i++) {
+      Serial.print(" ");
+      Serial.print((int16_t)ev.args[i]);
+    }
+    Serial.println();
+    n++;
+  }
+  if (n > 0 && trace_dropped > 0) {
+    Serial.print("trace dropped ");
+    Serial.println(trace_dropped);
+  }
+  return n;
+}
+
+uint32_t Trace::get_dropped() {
+  return trace_dropped;
+}
+
+void Trace::clear() {
+  trace_tail = trace_head;
+  trace_dropped = 0;
+}
@@ -0,0 +1,73 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "VGA_t4.h"
+
+// Leveled binary trace replacing Serial prints in the render paths.
+// Events are 16 bytes (cycle stamp, id, level, 5 args) stored in a RAM
+// ring, drained to Serial (or read back) when the game loop is idle.
+// Events above VGA_TRACE_LEVEL (VGA_t4.h) are not compiled in at all.
+// Log from the game loop only: the ring has a single producer.
+
+#define TRACE_LEVEL_ERROR    1
+#define TRACE_LEVEL_INFO     2
+#define TRACE_LEVEL_DEBUG    3
+#define TRACE_LEVEL_VERBOSE  4
+
+#define TRACE_RING_SIZE      256   // events, power of 2
+
+typedef enum trace_id_t
+{
+  TRACE_FRAME = 0,      // frame
+  TRACE_VIEWPORT,       // frame, col1, col2, row1, row2
+  TRACE_MAP_ROW,        // row, viewport line, screen line, crop top, crop bottom
+  TRACE_SPRITE,         // x, y, tile
+  TRACE_BITMAP_ROW,     // y, x, crop right, end col
+  TRACE_BITMAP_CROP,    // crop bottom
+  TRACE_TILE_ADD,       // tile index
+  TRACE_DEADLINE_MISS,  // first row, last row, beam row, frames late
+  TRACE_OCCLUSION,      // frame, occluded cells
+  TRACE_CHUNK_OVERRUN,  // chunks needed, max chunks
+  TRACE_IDS
+} trace_id_t;
+
+typedef struct {
+  uint32_t stamp;       // DWT cycles
+  uint8_t  id;
+  uint8_t  level;
+  uint16_t args[5];
+} trace_event_t;
+
+#if VGA_TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(id, ...)   Trace::log(TRACE_LEVEL_ERROR, (id), ##__VA_ARGS__)
+#else
+#define TRACE_ERROR(id, ...)
+#endif
+#if VGA_TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(id, ...)    Trace::log(TRACE_LEVEL_INFO, (id), ##__VA_ARGS__)
+#else
+#define TRACE_INFO(id, ...)
+#endif
+#if VGA_TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(id, ...)   Trace::log(TRACE_LEVEL_DEBUG, (id), ##__VA_ARGS__)
+#else
+#define TRACE_DEBUG(id, ...)
+#endif
+#if VGA_TRACE_LEVEL >= TRACE_LEVEL_VERBOSE
+#define TRACE_VERBOSE(id, ...) Trace::log(TRACE_LEVEL_VERBOSE, (id), ##__VA_ARGS__)
+#else
+#define TRACE_VERBOSE(id, ...)
+#endif
+
+class Trace {
+public:
+  static void log(uint8_t _level, uint8_t _id, uint16_t _a = 0, uint16_t _b = 0, uint16_t _c = 0, uint16_t _d = 0, uint16_t _e = 0);
+  // oldest event first, false when empty
+  static bool read(trace_event_t* _event);
+  // prints up to _max events, returns how many were printed
+  static uint16_t drain(uint16_t _max = TRACE_RING_SIZE);
+  static uint32_t get_dropped();
+  static void clear();
+};
+
+#endif